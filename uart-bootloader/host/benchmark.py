@@ -0,0 +1,192 @@
+'''
+Upload benchmark against the Linux build of the bootloader (host-bootloader).
+
+Every image of the corpus is uploaded with every transfer mode of uploader.py at each baudrate,
+each run on a freshly started host-bootloader (erased flash). The host build paces the pty at the
+emulated line rate and SPM erase / write take as long as on the device, only the AVR's CPU time
+is not modelled. Reports the upload time, bytes/s of image data, the round trips (host waits for a
+reply after sending) per KB and the share of the line rate the upload reached. The flash content
+is read back after every run, a mismatch fails the benchmark.
+
+Corpus: the led-fastblink / led-slowblink builds (Atmel Studio output in <project>/Debug/) and
+synthetic 4, 16 and 28 KB images. A missing build fails the benchmark, --synthetic-only leaves the
+led images out on purpose.
+'''
+import argparse
+import contextlib
+import io
+import json
+import os
+import random
+import subprocess
+import sys
+import time
+
+HOST_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HOST_DIR, '..', '..', 'uploader'))
+import uploader
+from serial import Serial
+
+MODES = ['hex', 'binary', 'window', 'page', 'compressed', 'diff']
+BOOTLOADER_START = 0x7000 # BL_INFO_BLSECTIONSTART of host-main.c
+SYNTHETIC_SIZES = [4, 16, 28]
+
+class CountingSerial:
+    '''Serial wrapper that counts a round trip every time a read follows a write'''
+    def __init__(self, ser):
+        self.ser = ser
+        self.round_trips = 0
+        self.bytes_written = 0
+        self.bytes_read = 0
+        self.wrote = False
+
+    def write(self, data):
+        self.wrote = True
+        self.bytes_written += len(data)
+        return self.ser.write(data)
+
+    def read(self, size=1):
+        if(self.wrote):
+            self.round_trips += 1
+            self.wrote = False
+        data = self.ser.read(size)
+        self.bytes_read += len(data)
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+    def __setattr__(self, name, value):
+        if(name in ['ser', 'round_trips', 'bytes_written', 'bytes_read', 'wrote']):
+            object.__setattr__(self, name, value)
+        else:
+            setattr(self.ser, name, value)
+
+def synthetic_image(size_kb, pagesize):
+    # code-like content: a small set of frequent opcodes with random operands, a few constant tables
+    rng = random.Random(size_kb)
+    opcodes = [0x0E, 0x2F, 0x80, 0x91, 0x93, 0xE0, 0xF4, 0x94, 0xCF, 0x95]
+    data = bytearray()
+    while(len(data) < size_kb * 1024):
+        if(rng.random() < 0.05):
+            data.extend(bytes([rng.randrange(256)]) * rng.randrange(4, 32))
+        else:
+            data.extend([rng.randrange(256), rng.choice(opcodes)])
+    lines = uploader.build_hex_records([(0, data[:size_kb * 1024])])
+    return uploader.parse_hex_image('\n'.join(lines).encode('ascii'), pagesize, False)
+
+def load_corpus(pagesize, synthetic_only):
+    corpus = []
+    for name in ([] if synthetic_only else ['led-fastblink', 'led-slowblink']):
+        filename = os.path.join(HOST_DIR, '..', name, 'Debug', name + '.hex')
+        if(not os.path.exists(filename)):
+            print(f'Error: {os.path.relpath(filename)} not found, build {name} first or run with --synthetic-only')
+            sys.exit(1)
+        with open(filename, 'rb') as fh:
+            corpus.append((name, uploader.parse_hex_image(fh.read(), pagesize, False)))
+    for size_kb in SYNTHETIC_SIZES:
+        corpus.append((f'synthetic-{size_kb}k', synthetic_image(size_kb, pagesize)))
+    return corpus
+
+def modified_image(image):
+    # same image with one byte changed in the last page, what the diff mode has to upload after a small change
+    modified = {'pagesize': image['pagesize'], 'pages': {index: (bytearray(page), bytearray(mask)) for (index, (page, mask)) in image['pages'].items()}}
+    (page, mask) = modified['pages'][max(modified['pages'])]
+    position = mask.rfind(1)
+    page[position] ^= 0xFF
+    return modified
+
+def run(binary, image, mode, baudrate, comdefines, line_rate, flow):
+    host = subprocess.Popen([binary] + ([] if line_rate else ['-n']), stdout=subprocess.PIPE, text=True)
+    port = host.stdout.readline().strip()
+    ser = CountingSerial(Serial(port, comdefines['BL_COM_BAUD_0'], timeout=5))
+    args = argparse.Namespace(verbose=False, replace=False, flow=flow)
+    output = io.StringIO()
+    image = dict(image, bootloader_start_address=BOOTLOADER_START)
+    uploader.comdefines = comdefines
+
+    try:
+        with contextlib.redirect_stdout(output):
+            if(baudrate != comdefines['BL_COM_BAUD_0']):
+                ser.baudrate = uploader.switch_baudrate(ser, baudrate, comdefines, args)
+            if(flow != 'none'):
+                args.flow = uploader.set_flow_control(ser, flow, comdefines)
+            upload_image = image
+            if(mode == 'diff'):
+                # the previous version is on the device already
+                uploader.upload_program_pages(ser, modified_image(image), comdefines, args)
+
+            ser.round_trips = ser.bytes_written = ser.bytes_read = 0
+            start = time.monotonic()
+            if(mode == 'hex'):
+                uploader.upload_program(ser, upload_image, comdefines, args)
+            elif(mode == 'binary'):
+                uploader.upload_program_binary(ser, upload_image, comdefines, args)
+            elif(mode == 'window'):
+                uploader.upload_program_windowed(ser, upload_image, comdefines, args)
+            elif(mode == 'compressed'):
+                uploader.upload_program_pages(ser, upload_image, comdefines, args, compressed=True)
+            elif(mode == 'diff'):
+                uploader.upload_program_changed_pages(ser, upload_image, comdefines, args)
+            else:
+                uploader.upload_program_pages(ser, upload_image, comdefines, args)
+            seconds = time.monotonic() - start
+            result = {'seconds': seconds, 'round_trips': ser.round_trips, 'bytes_written': ser.bytes_written, 'bytes_read': ser.bytes_read}
+
+            errors = 0
+            for (address, data) in uploader.image_ranges(image):
+                if(uploader.read_flash(ser, address, len(data), comdefines) != data):
+                    errors += 1
+            result['verify_errors'] = errors
+
+            ser.write(comdefines['BL_COM_CMD_QUIT'])
+            ser.read(size=1)
+    finally:
+        ser.close()
+        stats = host.stdout.readline()
+        if(host.wait(timeout=5) == 0 and stats):
+            result['host'] = json.loads(stats)
+
+    if(result['verify_errors'] > 0):
+        print(output.getvalue())
+    return result
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Upload benchmark against the Linux build of the bootloader')
+    parser.add_argument('--binary', default=os.path.join(HOST_DIR, 'host-bootloader'), help='host bootloader executable')
+    parser.add_argument('--baudrates', default='115200,1000000', help='comma separated baudrates (BL_COM_BAUD_n values)')
+    parser.add_argument('--modes', default=','.join(MODES), help='comma separated upload modes')
+    parser.add_argument('--no-line-rate', action='store_true', help='don\'t pace the pty at the baudrate')
+    parser.add_argument('--flow', choices=['none', 'credit'], default='none', help='flow control for the uploads (the pty has no RTS / CTS)')
+    parser.add_argument('--json', metavar='FILE', help='write the results to a json file')
+    parser.add_argument('--synthetic-only', action='store_true', help='only the synthetic images, without the led-* builds')
+    args = parser.parse_args()
+
+    comdefines = uploader.extract_com_constants(os.path.join(HOST_DIR, '..', 'uart-bootloader', 'bootloader-communication.h'))
+    corpus = load_corpus(comdefines['BL_COM_PAGESIZE'], args.synthetic_only)
+    baudrates = [int(baudrate) for baudrate in args.baudrates.split(',')]
+    modes = args.modes.split(',')
+
+    print(f'{"image":16} {"bytes":>6} {"mode":10} {"baud":>8} {"seconds":>8} {"bytes/s":>8} {"rt/KB":>6} {"line %":>6}')
+    results = []
+    failed = False
+    for (name, image) in corpus:
+        size = sum(len(data) for (address, data) in uploader.image_ranges(image))
+        for baudrate in baudrates:
+            for mode in modes:
+                result = run(args.binary, image, mode, baudrate, comdefines, not args.no_line_rate, args.flow)
+                result.update({'image': name, 'bytes': size, 'mode': mode, 'baudrate': baudrate})
+                results.append(result)
+
+                bytes_per_second = size / result['seconds']
+                round_trips_per_kb = result['round_trips'] / (size / 1024)
+                line_usage = 100 * result['bytes_written'] / (result['seconds'] * baudrate / 10)
+                status = '' if result['verify_errors'] == 0 else '  VERIFY FAILED'
+                print(f'{name:16} {size:6} {mode:10} {baudrate:8} {result["seconds"]:8.3f} {bytes_per_second:8.0f} {round_trips_per_kb:6.1f} {line_usage:6.1f}{status}')
+                failed |= result['verify_errors'] > 0
+
+    if(args.json):
+        with open(args.json, 'w') as fh:
+            json.dump(results, fh, indent=2)
+
+    sys.exit(1 if failed else 0)
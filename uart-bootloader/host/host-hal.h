@@ -0,0 +1,187 @@
+/*
+ * host-hal.h
+ *
+ * Stand-in for the avr-libc parts used by bootloader-core.h when building on Linux:
+ *	- a fake 32K flash with a temporary page buffer and ATmega328P programming rules
+ *	  (erase sets 0xFF, write can only clear bits, the buffer is cleared after a write)
+ *	- SPM timing: erase and write keep the flash busy for HOST_SPM_US microseconds
+ *	- the RWW section can't be read between erase / write and boot_rww_enable(),
+ *	  the core aborts with a message if it does
+ *	- a 1K EEPROM, a write that changes the byte keeps it busy for HOST_EEPROM_US microseconds,
+ *	  SPM and EEPROM writes must not overlap
+ */
+
+
+#ifndef HOST_HAL_H_
+#define HOST_HAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <alloca.h>
+
+#define SPM_PAGESIZE 128
+#define HOST_FLASHSIZE 32768
+
+// page erase / write time (datasheet: 3.7 - 4.5 ms)
+#ifndef HOST_SPM_US
+#define HOST_SPM_US 4000
+#endif // HOST_SPM_US
+
+#define HOST_EEPROMSIZE 1024
+
+// EEPROM erase + write time (datasheet: 3.3 ms)
+#ifndef HOST_EEPROM_US
+#define HOST_EEPROM_US 3300
+#endif // HOST_EEPROM_US
+
+#define PROGMEM
+#define pgm_read_byte(ptr) (*(const uint8_t*) (ptr))
+#define pgm_read_word(ptr) (*(const uint16_t*) (ptr))
+#define pgm_read_dword(ptr) (*(const uint32_t*) (ptr))
+#define pgm_read_ptr(ptr) (*(void* const*) (ptr))
+
+// there are no interrupts on the host, SREG only has to keep its value
+uint8_t SREG = 0;
+#define cli() (SREG &= 0x7F)
+#define sei() (SREG |= 0x80)
+
+static inline double host_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void host_sleep_us(uint32_t us) {
+	struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+	nanosleep(&ts, NULL);
+}
+
+#define _delay_ms(ms) host_sleep_us((ms) * 1000UL)
+#define _delay_us(us) host_sleep_us(us)
+
+uint8_t host_flash[HOST_FLASHSIZE];
+uint16_t host_page_buffer[SPM_PAGESIZE / 2];
+double host_spm_done = 0;
+uint8_t host_rww_busy = 0;
+uint8_t host_eeprom[HOST_EEPROMSIZE];
+double host_eeprom_done = 0;
+
+// statistics for the benchmark
+uint32_t host_pages_erased = 0, host_pages_written = 0;
+uint32_t host_eeprom_written = 0;
+double host_spm_wait = 0;
+
+static void host_fail(const char* message, uint16_t address) {
+	fprintf(stderr, "host-hal: %s (0x%04X)\n", message, address);
+	exit(2);
+}
+
+static inline uint8_t boot_spm_busy() {
+	return host_time() < host_spm_done;
+}
+
+static inline void boot_spm_busy_wait() {
+	double start = host_time();
+	while(boot_spm_busy()) ;
+	host_spm_wait += host_time() - start;
+}
+
+static inline int eeprom_is_ready() {
+	return host_time() >= host_eeprom_done;
+}
+
+static inline void eeprom_busy_wait() {
+	while(!eeprom_is_ready()) ;
+}
+
+static void host_spm_check(uint16_t address) {
+	if(boot_spm_busy())
+		host_fail("SPM instruction while the previous one is still busy", address);
+	if(!eeprom_is_ready())
+		host_fail("SPM instruction while an EEPROM write is busy", address);
+	if(address >= HOST_FLASHSIZE)
+		host_fail("SPM address outside of the flash", address);
+}
+
+static void boot_page_fill(uint16_t address, uint16_t word) {
+	host_spm_check(address);
+	host_page_buffer[(address % SPM_PAGESIZE) / 2] &= word;
+}
+
+static void boot_page_erase(uint16_t address) {
+	host_spm_check(address);
+	memset(host_flash + (address & ~(SPM_PAGESIZE - 1)), 0xFF, SPM_PAGESIZE);
+	host_spm_done = host_time() + HOST_SPM_US * 1e-6;
+	host_rww_busy = 1;
+	host_pages_erased++;
+}
+
+static void boot_page_write(uint16_t address) {
+	host_spm_check(address);
+	uint8_t* page = host_flash + (address & ~(SPM_PAGESIZE - 1));
+	for(uint8_t i = 0; i < SPM_PAGESIZE / 2; i++) {
+		page[2*i] &= (uint8_t) host_page_buffer[i];
+		page[2*i + 1] &= (uint8_t) (host_page_buffer[i] >> 8);
+	}
+	memset(host_page_buffer, 0xFF, sizeof(host_page_buffer));
+	host_spm_done = host_time() + HOST_SPM_US * 1e-6;
+	host_rww_busy = 1;
+	host_pages_written++;
+}
+
+// also clears the temporary page buffer, like RWWSRE does
+static void boot_rww_enable() {
+	host_spm_check(0);
+	memset(host_page_buffer, 0xFF, sizeof(host_page_buffer));
+	host_rww_busy = 0;
+}
+
+#define boot_rww_enable_safe() do { boot_spm_busy_wait(); boot_rww_enable(); } while(0)
+
+static inline uint8_t host_flash_read(uint16_t address) {
+	if(host_rww_busy)
+		host_fail("flash read while the RWW section is busy", address);
+	return host_flash[address % HOST_FLASHSIZE];
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t* address) {
+	eeprom_busy_wait();
+	return host_eeprom[(uintptr_t) address % HOST_EEPROMSIZE];
+}
+
+// like avr-libc: waits for the previous write, unchanged bytes aren't written
+static void eeprom_update_byte(uint8_t* address, uint8_t value) {
+	eeprom_busy_wait();
+	if(boot_spm_busy())
+		host_fail("EEPROM write while SPM is busy", (uintptr_t) address);
+	uint8_t* cell = &host_eeprom[(uintptr_t) address % HOST_EEPROMSIZE];
+	if(*cell == value)
+		return;
+	*cell = value;
+	host_eeprom_done = host_time() + HOST_EEPROM_US * 1e-6;
+	host_eeprom_written++;
+}
+
+#define flash_read_byte(addr) host_flash_read(addr)
+#define flash_read_word(addr) (host_flash_read(addr) | host_flash_read((addr) + 1) << 8)
+#define flash_read_dword(addr) (flash_read_word(addr) | (uint32_t) flash_read_word((addr) + 2) << 16)
+
+// fuses of the development board (see main.c)
+#define GET_LOW_FUSE_BITS 0
+#define GET_LOCK_BITS 1
+#define GET_EXTENDED_FUSE_BITS 2
+#define GET_HIGH_FUSE_BITS 3
+static const uint8_t host_fuses[4] = { 0xFF, 0xFF, 0xFD, 0xD8 };
+#define boot_lock_fuse_bits_get(which) host_fuses[which]
+
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+	crc ^= (uint16_t) data << 8;
+	for(uint8_t i = 0; i < 8; i++)
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+#endif /* HOST_HAL_H_ */
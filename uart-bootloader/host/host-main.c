@@ -0,0 +1,127 @@
+/*
+ * host-main.c
+ *
+ * Linux build of the bootloader core: fake flash (host-hal.h) and a pty as UART (host-usart.h).
+ * Prints the pty path on the first line, the uploader connects to it like to a board:
+ *	./host-bootloader &
+ *	python uploader.py --port /dev/pts/N --max-baudrate 0 -f firmware.hex
+ *
+ * Options:
+ *	-n		no line rate, the pty runs as fast as the host can
+ *	-s FILE	keep flash and EEPROM in FILE: loaded at the start, saved on exit (also on SIGTERM, like a power loss)
+ *	-r		start like main.c with BLE_ALWAYS after a power-on reset: prints "application started" and exits
+ *			if the application would be started
+ * After the quit command the statistics are printed as one JSON line.
+ */
+
+#define F_CPU 16000000
+#define BL_INFO_VERSION "0.1"
+#define BL_INFO_BLSECTIONSTART (2 * 0x3800)
+
+#include <signal.h>
+#include <stdint.h>
+#include "../uart-bootloader/bootloader-communication.h"
+#include "host-hal.h"
+
+// keep the flash programming and EEPROM writes going while waiting for UART data
+void bl_idle();
+#define USART_RX_IDLE() bl_idle()
+
+#define BAUDRATE BL_COM_BAUD_0
+#define BL_ENTRY_WINDOW_MS 250
+#include "host-usart.h"
+
+void set_rgb_leds(uint8_t flag) {
+}
+
+// protocol and flash programming
+#include "../uart-bootloader/bootloader-core.h"
+
+
+const char* state_file = NULL;
+
+static void state_save() {
+	FILE* fh = fopen(state_file, "wb");
+	if(fh == NULL || fwrite(host_flash, sizeof(host_flash), 1, fh) != 1 || fwrite(host_eeprom, sizeof(host_eeprom), 1, fh) != 1)
+		perror(state_file);
+	if(fh != NULL)
+		fclose(fh);
+}
+
+static void state_load() {
+	FILE* fh = fopen(state_file, "rb");
+	if(fh == NULL)
+		return;
+	if(fread(host_flash, sizeof(host_flash), 1, fh) != 1 || fread(host_eeprom, sizeof(host_eeprom), 1, fh) != 1) {
+		fprintf(stderr, "%s: not a state file\n", state_file);
+		exit(1);
+	}
+	fclose(fh);
+}
+
+// the power goes away in the middle of whatever the bootloader does
+static void on_sigterm(int sig) {
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	uint8_t power_on = 0;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-n") == 0) {
+			usart_line_rate = 0;
+		} else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			state_file = argv[++i];
+		} else if(strcmp(argv[i], "-r") == 0) {
+			power_on = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-n] [-s FILE] [-r]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	memset(host_flash, 0xFF, sizeof(host_flash));
+	memset(host_page_buffer, 0xFF, sizeof(host_page_buffer));
+	memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+	if(state_file != NULL) {
+		state_load();
+		atexit(state_save);
+		signal(SIGTERM, on_sigterm);
+	}
+
+	const char* port = USART_Open();
+	if(port == NULL) {
+		perror("pty");
+		return 1;
+	}
+	printf("%s\n", port);
+	fflush(stdout);
+
+	USART_Init();
+
+	// main.c, BLE_ALWAYS after a power-on reset
+	if(power_on) {
+		uint8_t application_broken = app_broken();
+		if(!application_broken && app_valid()) {
+			printf("application started\n");
+			return 0;
+		}
+		USART_Transmit(BL_COM_BL_READY);
+		if(!application_broken && USART_AwaitRX(BL_ENTRY_WINDOW_MS)) {
+			printf("application started\n");
+			return 0;
+		}
+	}
+
+	double start = host_time();
+	bootloader_run();
+
+	USART_Flush();
+	USART_Close(2000);
+	eeprom_sync();
+	flash_sync();
+	boot_rww_enable_safe();
+
+	printf("{\"seconds\": %.3f, \"bytes_received\": %u, \"bytes_sent\": %u, \"pages_erased\": %u, \"pages_written\": %u, \"spm_wait_seconds\": %.3f, \"eeprom_bytes_written\": %u}\n",
+		host_time() - start, usart_bytes_received, usart_bytes_sent, host_pages_erased, host_pages_written, host_spm_wait, host_eeprom_written);
+	return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * host-usart.h
+ *
+ * MyUSART.h API on a Linux pseudo terminal, the uploader opens the slave side (see host-main.c).
+ *
+ * The pty itself has no line rate, so the bytes are paced like on the wire at the baudrate
+ * set with USART_Init() / USART_SetBaud() (10 bits per byte): received bytes become available
+ * one byte time after each other, transmitted bytes are queued like in the TX ring buffer of
+ * MyUSART.h and written to the pty once they would have left the shift register.
+ * usart_line_rate = 0 turns the pacing off.
+ */
+
+
+#ifndef HOST_USART_H_
+#define HOST_USART_H_
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifndef BAUDRATE // allow custom baudrate
+#define BAUDRATE 9600
+#endif // BAUDRATE
+
+#define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
+
+// rounded UBRR values for normal and double speed (U2X) mode
+#define USART_UBRR(baud) (((F_CPU) + 8UL*(baud)) / (16UL*(baud)) - 1)
+#define USART_UBRR_U2X(baud) (((F_CPU) + 4UL*(baud)) / (8UL*(baud)) - 1)
+
+// same window as the device, the host side of the pty buffers everything else
+#ifndef RX_BUFFERSIZE
+#define RX_BUFFERSIZE 128
+#endif // RX_BUFFERSIZE
+
+#ifndef USART_RX_IDLE
+#define USART_RX_IDLE()
+#endif // USART_RX_IDLE
+
+#ifndef TX_BUFFERSIZE
+#define TX_BUFFERSIZE 32
+#endif // TX_BUFFERSIZE
+
+#define RX_FREE_XOFF 4
+#define RX_FREE_XON 16
+
+// a pty has no RTS / CTS lines and the local buffer never runs full, so only the credit limit has an effect
+#define USART_FLOW_NONE 0
+#define USART_FLOW_XONXOFF 1
+#define USART_FLOW_RTSCTS 2
+#define USART_FLOW_CREDIT 3
+
+int usart_fd = -1;
+uint8_t usart_line_rate = 1;
+uint8_t usartFlowControl = USART_FLOW_NONE;
+double usart_byte_time = 0;
+
+uint8_t usart_rx[4096];
+double usart_rx_time[4096];
+uint16_t usart_rx_start = 0, usart_rx_end = 0;
+double usart_rx_last = 0, usart_tx_done = 0;
+
+uint8_t usart_tx[TX_BUFFERSIZE];
+double usart_tx_time[TX_BUFFERSIZE];
+uint8_t usart_tx_start = 0, usart_tx_end = 0;
+
+// statistics for the benchmark
+uint32_t usart_bytes_received = 0, usart_bytes_sent = 0;
+
+// opens the pty master, returns the slave path for the uploader
+const char* USART_Open() {
+	usart_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(usart_fd < 0 || grantpt(usart_fd) || unlockpt(usart_fd))
+		return NULL;
+
+	struct termios tio;
+	tcgetattr(usart_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(usart_fd, TCSANOW, &tio);
+	return ptsname(usart_fd);
+}
+
+void USART_SetBaud(uint16_t ubrr, uint8_t double_speed) {
+	double baud = (double) F_CPU / ((double_speed ? 8 : 16) * (ubrr + 1.0));
+	usart_byte_time = usart_line_rate ? 10.0 / baud : 0;
+}
+
+void USART_Init() {
+	USART_SetBaud(BAUD_CONST, 0);
+}
+
+uint8_t USART_SetFlowControl(uint8_t mode) {
+	if(mode > USART_FLOW_CREDIT || mode == USART_FLOW_RTSCTS)
+		return 1;
+	usartFlowControl = mode;
+	return 0;
+}
+
+// writes the queued bytes that are complete on the emulated line
+static void usart_tx_pump() {
+	double now = host_time();
+	while(usart_tx_start != usart_tx_end && usart_tx_time[usart_tx_start] <= now) {
+		// without an open slave side there is nobody to talk to anymore
+		if(write(usart_fd, &usart_tx[usart_tx_start], 1) != 1) {
+			fprintf(stderr, "host-usart: uploader disconnected\n");
+			exit(1);
+		}
+		usart_tx_start = (usart_tx_start + 1) % TX_BUFFERSIZE;
+	}
+}
+
+// moves the bytes written by the uploader into the local buffer, waits up to timeout_ms for them
+static void usart_poll(int timeout_ms) {
+	usart_tx_pump();
+	if(usart_tx_start != usart_tx_end)
+		timeout_ms = 0;
+	struct pollfd pfd = { usart_fd, POLLIN, 0 };
+	if(poll(&pfd, 1, timeout_ms) <= 0)
+		return;
+	if(!(pfd.revents & POLLIN)) {
+		// POLLHUP: the uploader didn't open the slave side yet or closed it
+		host_sleep_us(1000);
+		return;
+	}
+
+	uint8_t data[256];
+	uint16_t space = (usart_rx_start - usart_rx_end - 1) % sizeof(usart_rx);
+	ssize_t n = read(usart_fd, data, space < sizeof(data) ? space : sizeof(data));
+	double now = host_time();
+	for(ssize_t i = 0; i < n; i++) {
+		// a byte is complete one byte time after the previous one
+		usart_rx_last = (now > usart_rx_last ? now : usart_rx_last) + usart_byte_time;
+		usart_rx[usart_rx_end] = data[i];
+		usart_rx_time[usart_rx_end] = usart_rx_last;
+		usart_rx_end = (usart_rx_end + 1) % sizeof(usart_rx);
+	}
+}
+
+// with credit based flow control the sender must never have more than RX_BUFFERSIZE received bytes waiting
+static void usart_check_credit() {
+	double now = host_time();
+	uint16_t waiting = 0;
+	for(uint16_t i = usart_rx_start; i != usart_rx_end && usart_rx_time[i] <= now; i = (i + 1) % sizeof(usart_rx))
+		waiting++;
+	if(waiting > RX_BUFFERSIZE) {
+		fprintf(stderr, "host-usart: %u bytes waiting, the credit limit was exceeded\n", waiting);
+		exit(1);
+	}
+}
+
+static uint8_t usart_rx_available() {
+	if(usartFlowControl == USART_FLOW_CREDIT)
+		usart_check_credit();
+	if(usart_rx_start == usart_rx_end)
+		usart_poll(0);
+	return usart_rx_start != usart_rx_end && usart_rx_time[usart_rx_start] <= host_time();
+}
+
+// queues a byte, only waits if the buffer is full
+void USART_Transmit(char data) {
+	uint8_t next = (usart_tx_end + 1) % TX_BUFFERSIZE;
+	while(next == usart_tx_start)
+		usart_tx_pump();
+
+	double now = host_time();
+	usart_tx_done = (now > usart_tx_done ? now : usart_tx_done) + usart_byte_time;
+	usart_tx[usart_tx_end] = data;
+	usart_tx_time[usart_tx_end] = usart_tx_done;
+	usart_tx_end = next;
+	usart_bytes_sent++;
+	usart_tx_pump();
+}
+
+void USART_Flush() {
+	while(usart_tx_start != usart_tx_end)
+		usart_tx_pump();
+	tcdrain(usart_fd);
+}
+
+// closing the master discards what the uploader didn't read yet, so wait until it closes the port
+void USART_Close(uint16_t timeout_ms) {
+	struct pollfd pfd = { usart_fd, 0, 0 };
+	double timeout = host_time() + timeout_ms * 1e-3;
+	while(host_time() < timeout) {
+		if(poll(&pfd, 1, 10) > 0 && (pfd.revents & POLLHUP))
+			break;
+	}
+	close(usart_fd);
+}
+
+void USART_TransmitAndDrain(char data) {
+	USART_Transmit(data);
+	USART_Flush();
+}
+
+void USART_TransmitMultiple(char* data, uint8_t len) {
+	for(uint8_t i = 0; i < len; i++)
+		USART_Transmit(data[i]);
+}
+
+char USART_Receive() {
+	while(!usart_rx_available()) {
+		USART_RX_IDLE();
+		usart_poll(usart_rx_start == usart_rx_end ? 1 : 0);
+	}
+
+	char rx = usart_rx[usart_rx_start];
+	usart_rx_start = (usart_rx_start + 1) % sizeof(usart_rx);
+	usart_bytes_received++;
+	return rx;
+}
+
+// same contract as on the device: a piece of the receive buffer, released with USART_ReceiveCommit()
+uint8_t USART_ReceiveSpan(uint8_t** span, uint8_t max) {
+	while(!usart_rx_available()) {
+		USART_RX_IDLE();
+		usart_poll(usart_rx_start == usart_rx_end ? 1 : 0);
+	}
+
+	// only the bytes that are complete on the emulated line
+	double now = host_time();
+	uint8_t len = 0;
+	uint16_t i = usart_rx_start;
+	while(len < max && i != usart_rx_end && i < sizeof(usart_rx) && usart_rx_time[i] <= now) {
+		len++;
+		i++;
+	}
+
+	*span = usart_rx + usart_rx_start;
+	return len;
+}
+
+void USART_ReceiveCommit(uint8_t len) {
+	usart_rx_start = (usart_rx_start + len) % sizeof(usart_rx);
+	usart_bytes_received += len;
+}
+
+static inline uint8_t USART_RXConsumed() {
+	return usart_bytes_received;
+}
+
+void USART_ReceiveMultiple(char* buffer, uint8_t bufsize) {
+	for(uint8_t i = 0; i < bufsize; i++) {
+		buffer[i] = USART_Receive();
+	}
+}
+
+// the local buffer holds everything the pty delivers, no byte is ever dropped
+static inline uint8_t USART_Overrun() {
+	return 0;
+}
+
+#define USART_TICKS_PER_MS 10
+
+// waits for a byte without taking it from the buffer, the time spent is taken from *ticks (100 us each)
+// so several calls can share one deadline, returns 1 once the ticks are used up
+uint8_t USART_AwaitRXTicks(uint16_t* ticks) {
+	double start = host_time();
+	double timeout = start + *ticks * 1e-4;
+	uint8_t expired = 0;
+	while(!usart_rx_available()) {
+		if(host_time() >= timeout) {
+			expired = 1;
+			break;
+		}
+		USART_RX_IDLE();
+		usart_poll(usart_rx_start == usart_rx_end ? 1 : 0);
+	}
+
+	uint32_t spent = (host_time() - start) * 1e4;
+	*ticks = spent < *ticks ? *ticks - spent : 0;
+	return expired;
+}
+
+// waits for a byte without taking it from the buffer, returns 1 if none arrived within timeout_ms
+uint8_t USART_AwaitRX(uint16_t timeout_ms) {
+	uint16_t ticks = timeout_ms * USART_TICKS_PER_MS;
+	return USART_AwaitRXTicks(&ticks);
+}
+
+// returns 1 if no byte arrived within timeout_ms
+uint8_t USART_ReceiveTimeout(char* data, uint16_t timeout_ms) {
+	if(USART_AwaitRX(timeout_ms))
+		return 1;
+
+	*data = USART_Receive();
+	return 0;
+}
+
+// timeout_ms applies to every single byte, returns 1 on timeout
+uint8_t USART_ReceiveMultipleTimeout(char* buffer, uint8_t bufsize, uint16_t timeout_ms) {
+	for(uint8_t i = 0; i < bufsize; i++) {
+		if(USART_ReceiveTimeout(buffer + i, timeout_ms))
+			return 1;
+	}
+	return 0;
+}
+
+// drop received bytes until the line was idle for idle_ms
+void USART_DiscardRX(uint16_t idle_ms) {
+	char dummy;
+	while(!USART_ReceiveTimeout(&dummy, idle_ms)) ;
+}
+
+void USART_TransmitString(const char dataarr[]) {
+	int i = 0;
+	while(dataarr[i] != '\0')
+		USART_Transmit(dataarr[i++]);
+}
+
+#endif /* HOST_USART_H_ */
@@ -0,0 +1,483 @@
+'''
+Protocol tests against the Linux build of the bootloader (host-bootloader).
+
+Every test runs on a freshly started host-bootloader (erased flash) and checks the replies and the
+flash content read back with 'd'. The system tests start their own instances (power-on emulation,
+several ports), the parser tests need none. Exits with 1 if a test fails.
+'''
+import argparse
+import binascii
+import contextlib
+import io
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+HOST_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HOST_DIR, '..', '..', 'uploader'))
+import uploader
+from serial import Serial
+
+def hex_record(address, data, rtype=0, checksum_error=False):
+    record = bytearray([len(data), address >> 8, address & 0xFF, rtype]) + bytes(data)
+    record.append((-sum(record) + (1 if checksum_error else 0)) & 0xFF)
+    return b':' + record.hex().upper().encode('ascii')
+
+def upload_records(ser, records, comdefines):
+    '''sends the records of a hex upload, returns the replies up to the first error or FINISHED'''
+    ser.write(comdefines['BL_COM_CMD_UPLOAD'])
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return None
+    replies = []
+    for record in records:
+        ser.write(record)
+        reply = ser.read(1)
+        if(len(reply) == 0):
+            break
+        replies.append(reply[0])
+        if(reply[0] & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']
+            or reply[0] == comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']):
+            break
+    return replies
+
+def hex_image(data, comdefines, address=0):
+    '''data at address as uploader.py parses it from a hex file'''
+    records = [hex_record(address + offset, data[offset:offset + 16]) for offset in range(0, len(data), 16)]
+    return uploader.parse_hex_image(b'\n'.join(records + [hex_record(0, b'', rtype=1)]), comdefines['BL_COM_PAGESIZE'], False)
+
+def quiet(function, *args):
+    '''calls an uploader function without its output, returns its result and the output'''
+    output = io.StringIO()
+    with contextlib.redirect_stdout(output):
+        result = function(*args)
+    return result, output.getvalue()
+
+class LossySerial:
+    '''Serial wrapper that drops or corrupts single write() calls, counted from 0'''
+    def __init__(self, ser, drop=(), corrupt=()):
+        self.ser = ser
+        self.drop = drop
+        self.corrupt = corrupt
+        self.writes = 0
+
+    def write(self, data):
+        index = self.writes
+        self.writes += 1
+        if(index in self.drop):
+            return len(data)
+        if(index in self.corrupt):
+            # last data byte of a frame, the crc follows
+            data = bytearray(data)
+            data[-3] ^= 0x01
+        return self.ser.write(data)
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+    def __setattr__(self, name, value):
+        if(name in ['ser', 'drop', 'corrupt', 'writes']):
+            object.__setattr__(self, name, value)
+        else:
+            setattr(self.ser, name, value)
+
+def mark_valid(ser, data, comdefines):
+    '''sends the descriptor of data at address 0 with 'a', returns the reply after the OK'''
+    descriptor = len(data).to_bytes(2, 'big') + zlib.crc32(data).to_bytes(4, 'big') + (1).to_bytes(2, 'big')
+    ser.write(comdefines['BL_COM_CMD_APPVALID'] + descriptor)
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return None
+    return ser.read(1)
+
+def start_host(binary, comdefines, *options):
+    host = subprocess.Popen([binary, '-n', *options], stdout=subprocess.PIPE, text=True)
+    port = host.stdout.readline().strip()
+    return host, Serial(port, comdefines['BL_COM_BAUD_0'], timeout=5)
+
+def test_corrupt_record_across_pages(ser, comdefines):
+    '''a record with a bad checksum that crosses a page boundary must not change the flash'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    finished = comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']
+    checksum_error = comdefines['BL_COM_REPLY_UPLOADERROR'] | comdefines['BL_COM_UPLOADERR_CHECKSUM']
+
+    # first two pages programmed with a known pattern
+    data = bytes(range(256))[:2 * pagesize]
+    records = [hex_record(address, data[address:address + 16]) for address in range(0, len(data), 16)]
+    if(upload_records(ser, records + [hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+        return 'upload of the pattern failed'
+    before = uploader.read_flash(ser, 0, 3 * pagesize, comdefines)
+
+    # 32 bytes starting 16 bytes before the end of page 0, then a good record in the same upload
+    corrupt = hex_record(pagesize - 16, bytes(32), checksum_error=True)
+    replies = upload_records(ser, [corrupt, hex_record(2 * pagesize, bytes(16)), hex_record(0, b'', rtype=1)], comdefines)
+    if(replies != [checksum_error]):
+        return f'replies {[hex(reply) for reply in replies or []]}, expected the checksum error only'
+    if(uploader.read_flash(ser, 0, 3 * pagesize, comdefines) != before):
+        return 'flash changed by the corrupt record'
+    return None
+
+def test_record_across_pages(ser, comdefines):
+    '''a good record that crosses a page boundary is programmed into both pages'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    data = bytes(range(100, 140))
+    replies = upload_records(ser, [hex_record(pagesize - 8, data), hex_record(0, b'', rtype=1)], comdefines)
+    if(replies != [comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_LINEOK'], comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']]):
+        return f'replies {[hex(reply) for reply in replies or []]}'
+    if(uploader.read_flash(ser, pagesize - 8, len(data), comdefines) != data):
+        return 'record not in flash'
+    return None
+
+def test_upload_mode_reset_after_error(ser, comdefines):
+    '''the replace mode of an upload that failed doesn't apply to the next upload'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    finished = comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']
+    data = bytes(range(pagesize))
+    if(upload_records(ser, [hex_record(0, data), hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+        return 'upload of the pattern failed'
+
+    ser.write(comdefines['BL_COM_CMD_UPLOADMODE'] + bytes([comdefines['BL_COM_UPLOADMODE_REPLACE']]))
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return 'upload mode not set'
+    if(upload_records(ser, [hex_record(0, bytes(16), checksum_error=True)], comdefines)[-1] == finished):
+        return 'corrupt record accepted'
+
+    # without the replace mode the rest of the page is read back from the flash
+    if(upload_records(ser, [hex_record(0, bytes(16)), hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+        return 'second upload failed'
+    if(uploader.read_flash(ser, 0, pagesize, comdefines) != bytes(16) + data[16:]):
+        return 'rest of the page not preserved, the replace mode was still set'
+    return None
+
+def test_windowed_upload_refused_in_replace_mode(ser, comdefines):
+    ''''w' can't honour the replace mode, it refuses to start instead of ignoring it'''
+    ser.write(comdefines['BL_COM_CMD_UPLOADMODE'] + bytes([comdefines['BL_COM_UPLOADMODE_REPLACE']]))
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return 'upload mode not set'
+    ser.write(comdefines['BL_COM_CMD_UPLOADWINDOWED'])
+    reply = ser.read(3)
+    if(reply != bytes([comdefines['BL_COM_REPLY_OK'], 0, comdefines['BL_COM_REPLY_INVALIDARG']])):
+        return f'reply {reply.hex()}, expected OK, window 0, INVALIDARG'
+    return None
+
+def test_windowed_upload_resend(ser, comdefines):
+    '''a lost frame is resent after the reply timeout, a corrupt one after its NAK, the others stay acknowledged'''
+    data = bytes(range(256)) * 4
+    args = argparse.Namespace(verbose=False, replace=False, flow='none')
+    # write 0 is the command, frame n is write n + 1
+    lossy = LossySerial(ser, drop=[3], corrupt=[8])
+    (ok, output) = quiet(uploader.upload_program_windowed, lossy, hex_image(data, comdefines), comdefines, args)
+    if(not ok):
+        return 'upload failed: ' + output.strip().splitlines()[-1]
+    if('(2 retransmissions)' not in output):
+        return 'expected one timeout and one NAK: ' + output.strip().splitlines()[-1]
+    if(uploader.read_flash(ser, 0, len(data), comdefines) != data):
+        return 'flash differs from the image'
+    return None
+
+def test_compressed_round_trip(ser, comdefines):
+    '''pages with long matches, short repeats, incompressible data and an uncovered tail decode to the image'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    noise = random.Random(9).randbytes(pagesize)
+    data = bytes(pagesize) + bytes(range(8)) * (pagesize // 8) + noise + noise[:pagesize // 2] + noise[:pagesize // 2] + noise[:40]
+    args = argparse.Namespace(verbose=False, replace=False, flow='none')
+    (ok, output) = quiet(uploader.upload_program_pages, ser, hex_image(data, comdefines), comdefines, args, None, True)
+    if(not ok):
+        return 'upload failed: ' + output.strip().splitlines()[-1]
+    pages = (len(data) + pagesize - 1) // pagesize
+    if(uploader.read_flash(ser, 0, pages * pagesize, comdefines) != data + b'\xFF' * (pages * pagesize - len(data))):
+        return 'flash differs from the image'
+    return None
+
+def test_eeprom_write_crc_dump(ser, comdefines):
+    ''''E' frames read back with 'H' and 'D', unchanged ranges aren't resent, the bootloader bytes are refused'''
+    appsize = comdefines['BL_COM_EEPROM_APPSIZE']
+    image = hex_image(bytes(range(100)), comdefines, 0x10)
+    uploader.image_store(image, appsize - 8, b'tail8888')
+    args = argparse.Namespace(verbose=False)
+    if(not quiet(uploader.upload_eeprom, ser, image, comdefines, args)[0]):
+        return 'eeprom upload failed'
+    for (address, data) in uploader.image_ranges(image):
+        if(uploader.eeprom_crc(ser, address, len(data), comdefines) != zlib.crc32(data)):
+            return f'crc of 0x{address:04X} differs from the image'
+        if(uploader.read_eeprom(ser, address, len(data), comdefines) != data):
+            return f'dump of 0x{address:04X} differs from the image'
+
+    uploader.image_store(image, 0x10, b'changed')
+    (ok, output) = quiet(uploader.upload_eeprom, ser, image, comdefines, args)
+    if(not ok or '1 of 2 ranges changed' not in output):
+        return 'only the changed range should be sent: ' + output.strip().splitlines()[-1]
+    if(uploader.read_eeprom(ser, 0x10, 100, comdefines) != b'changed' + bytes(range(7, 100))):
+        return 'changed range not written'
+
+    reserved = uploader.read_eeprom(ser, appsize, comdefines['BL_COM_EEPROM_SIZE'] - appsize, comdefines)
+    ser.write(comdefines['BL_COM_CMD_EEPROMWRITE'] + uploader.build_frame(appsize - 4, bytes(8)))
+    reply = ser.read(2)
+    if(reply != bytes([comdefines['BL_COM_REPLY_OK'], comdefines['BL_COM_REPLY_UPLOADERROR'] | comdefines['BL_COM_UPLOADERR_ADDRESS']])):
+        return f'reply {reply.hex()} to a frame into the bootloader bytes, expected the address error'
+    if(uploader.read_eeprom(ser, appsize, len(reserved), comdefines) != reserved):
+        return 'bootloader bytes changed'
+    return None
+
+def test_sync_after_aborted_frame(ser, comdefines):
+    ''''s' gets through once the fill ends a frame the previous session cut off, the next command works'''
+    # header of a full frame and only 10 of its bytes: the bootloader waits for the rest
+    frame = uploader.build_frame(0, bytes(comdefines['BL_COM_FRAME_MAXDATA']))
+    ser.write(comdefines['BL_COM_CMD_EEPROMWRITE'] + frame[:13])
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return 'eeprom write not started'
+    (ok, output) = quiet(uploader.sync_bootloader, ser, comdefines, argparse.Namespace(verbose=True))
+    if(not ok):
+        return 'no sync reply'
+    attempts = int(output.split(' attempts')[0].split()[-1])
+    if(attempts <= uploader.SYNC_FILL_ATTEMPT):
+        return f'in sync after {attempts} attempts, before the fill was sent'
+    if(uploader.read_flash(ser, 0, 16, comdefines) != b'\xFF' * 16):
+        return 'dump after the sync failed'
+    return None
+
+def test_descriptor_mismatch_clears_marker(ser, comdefines):
+    '''an 'a' descriptor that doesn't match the flash gets CHECKSUM and clears the marker of the image marked before'''
+    finished = comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']
+    marker = comdefines['BL_COM_EEPROM_APPSIZE']
+    data = bytes(range(256))
+    records = [hex_record(address, data[address:address + 16]) for address in range(0, len(data), 16)]
+    if(upload_records(ser, records + [hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+        return 'upload failed'
+    if(mark_valid(ser, data, comdefines) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return 'application not marked'
+    valid = uploader.read_eeprom(ser, marker, 1, comdefines)
+
+    reply = mark_valid(ser, data[:-1] + b'\x00', comdefines)
+    if(reply != bytes([comdefines['BL_COM_REPLY_UPLOADERROR'] | comdefines['BL_COM_UPLOADERR_CHECKSUM']])):
+        return f'reply {reply.hex()} to the wrong descriptor, expected the checksum error'
+    if(uploader.read_eeprom(ser, marker, 1, comdefines) == valid):
+        return 'marker still set'
+
+    # a gapped image whose gaps aren't erased is reported as a failure, not as done
+    image = hex_image(data[:16], comdefines)
+    uploader.image_store(image, 0x40, data[0x40:0x50])
+    args = argparse.Namespace(app_version=1)
+    (ok, output) = quiet(uploader.mark_application_valid, ser, image, comdefines, args)
+    if(ok or 'not marked' not in output):
+        return 'unmarked gapped image reported as marked'
+    return None
+
+def test_page_crcs_changed_pages(ser, comdefines):
+    ''''c' returns the CRC-16 of every application page, the diff upload only sends the pages that differ'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    data = bytes(range(256)) * 4
+    args = argparse.Namespace(verbose=False, replace=False, flow='none')
+    if(not quiet(uploader.upload_program_changed_pages, ser, hex_image(data, comdefines), comdefines, args)[0]):
+        return 'first upload failed'
+    crcs = uploader.read_page_crcs(ser, comdefines)
+    erased = binascii.crc_hqx(b'\xFF' * pagesize, 0)
+    for address in range(0, pagesize * len(crcs), pagesize):
+        expected = binascii.crc_hqx(data[address:address + pagesize], 0) if address < len(data) else erased
+        if(crcs[address] != expected):
+            return f'crc of page 0x{address:04X} is 0x{crcs[address]:04X}, expected 0x{expected:04X}'
+
+    changed = bytearray(data)
+    changed[pagesize + 5] ^= 0xFF
+    (ok, output) = quiet(uploader.upload_program_changed_pages, ser, hex_image(changed, comdefines), comdefines, args)
+    if(not ok or f'1 of {len(data) // pagesize} pages changed' not in output):
+        return 'expected one changed page: ' + output.strip().splitlines()[0]
+    if(uploader.read_flash(ser, 0, len(data), comdefines) != changed):
+        return 'flash differs from the image'
+    return None
+
+def test_verify_crc(ser, comdefines):
+    ''''h' returns the CRC-32 of any range, the verification reads back only a range that differs and counts its bytes'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    data = bytes(range(256)) * 2
+    finished = comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']
+    records = [hex_record(address, data[address:address + 16]) for address in range(0, len(data), 16)]
+    if(upload_records(ser, records + [hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+        return 'upload failed'
+
+    # odd start and length across a page boundary
+    (address, length) = (pagesize - 3, pagesize + 7)
+    ser.write(comdefines['BL_COM_CMD_VERIFYCRC'] + address.to_bytes(2, 'big') + length.to_bytes(2, 'big'))
+    if(ser.read(1) != bytes([comdefines['BL_COM_REPLY_OK']])):
+        return 'verify crc request failed'
+    crc = int.from_bytes(ser.read(4), 'big')
+    if(crc != zlib.crc32(data[address:address + length])):
+        return f'crc 0x{crc:08X}, expected 0x{zlib.crc32(data[address:address + length]):08X}'
+
+    args = argparse.Namespace(verbose=False)
+    if(not quiet(uploader.verify_program, ser, hex_image(data, comdefines), comdefines, args)[0]):
+        return 'verification of the uploaded image failed'
+    changed = bytearray(data)
+    changed[100] ^= 0x01
+    changed[300] ^= 0x01
+    (ok, output) = quiet(uploader.verify_program, ser, hex_image(changed, comdefines), comdefines, args)
+    if(ok or 'Errors detected: 2' not in output):
+        return 'expected two differing bytes: ' + output.strip().splitlines()[-1]
+    return None
+
+TESTS = [test_corrupt_record_across_pages, test_record_across_pages, test_upload_mode_reset_after_error,
+    test_windowed_upload_refused_in_replace_mode, test_windowed_upload_resend, test_compressed_round_trip,
+    test_eeprom_write_crc_dump, test_sync_after_aborted_frame, test_descriptor_mismatch_clears_marker,
+    test_page_crcs_changed_pages, test_verify_crc]
+
+def power_on(binary, state, comdefines):
+    '''starts the bootloader like main.c after a power-on reset, returns what runs: 'application', 'bootloader' or None'''
+    host, ser = start_host(binary, comdefines, '-s', state, '-r')
+    reply = b''
+    try:
+        # after the entry window (250 ms) only a bootloader that stays active still answers
+        time.sleep(0.5)
+        if(host.poll() is None):
+            ser.write(comdefines['BL_COM_CMD_QUIT'])
+            reply = ser.read(2)
+    finally:
+        ser.close()
+        output = host.stdout.read()
+        host.wait(timeout=5)
+    if('application started' in output):
+        return 'application'
+    if(reply == comdefines['BL_COM_BL_READY'] + bytes([comdefines['BL_COM_REPLY_QUITTING']])):
+        return 'bootloader'
+    return None
+
+def test_torn_upload_stays_in_bootloader(binary, comdefines):
+    '''an upload cut off by a power loss leaves the marker at incomplete, the half-written image is never started'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    finished = comdefines['BL_COM_REPLY_OK'] | comdefines['BL_COM_UPLOADOK_FINISHED']
+    data = bytes(range(256)) * 4
+    records = [hex_record(address, data[address:address + 16]) for address in range(0, len(data), 16)]
+    with tempfile.TemporaryDirectory() as tmp:
+        state = os.path.join(tmp, 'state')
+
+        # a complete and marked application
+        host, ser = start_host(binary, comdefines, '-s', state)
+        try:
+            if(upload_records(ser, records + [hex_record(0, b'', rtype=1)], comdefines)[-1] != finished):
+                return 'upload failed'
+            if(mark_valid(ser, data, comdefines) != bytes([comdefines['BL_COM_REPLY_OK']])):
+                return 'application not marked'
+            ser.write(comdefines['BL_COM_CMD_QUIT'])
+            ser.read(1)
+        finally:
+            ser.close()
+            host.stdout.read()
+            host.wait(timeout=5)
+        if(power_on(binary, state, comdefines) != 'application'):
+            return 'marked application not started'
+
+        # the next upload loses power after its first pages
+        host, ser = start_host(binary, comdefines, '-s', state)
+        try:
+            if(upload_records(ser, records[:3 * pagesize // 16], comdefines)[-1] & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+                return 'partial upload failed'
+        finally:
+            ser.close()
+            host.terminate()
+            host.stdout.read()
+            host.wait(timeout=5)
+        running = power_on(binary, state, comdefines)
+        if(running != 'bootloader'):
+            return f'{running or "nothing"} running after the torn upload, expected the bootloader'
+    return None
+
+def test_ports_flash_two_devices(binary, comdefines):
+    '''uploader.py --ports flashes two bootloaders at once, both results are OK and both flashes hold the image'''
+    data = bytes(range(256)) * 3 + bytes(range(0, 256, 2))
+    with tempfile.TemporaryDirectory() as tmp:
+        filename = os.path.join(tmp, 'app.hex')
+        uploader.write_hex_file(filename, [(0, data)])
+        states = [os.path.join(tmp, f'state{i}') for i in range(2)]
+        hosts = [start_host(binary, comdefines, '-s', state) for state in states]
+        for (host, ser) in hosts:
+            ser.close()
+        try:
+            result = subprocess.run([sys.executable, os.path.join(HOST_DIR, '..', '..', 'uploader', 'uploader.py'),
+                '--ports', *[ser.port for (host, ser) in hosts], '-f', filename, '--baudrate', str(comdefines['BL_COM_BAUD_0']),
+                '--max-baudrate', '0', '--no-cache'], capture_output=True, text=True, timeout=60)
+        finally:
+            for (host, ser) in hosts:
+                if(host.poll() is None):
+                    host.terminate()
+                host.stdout.read()
+                host.wait(timeout=5)
+        if(result.returncode != 0 or '2 of 2 devices OK' not in result.stdout):
+            return f'uploader returned {result.returncode}: ' + (result.stdout + result.stderr).strip().splitlines()[-1]
+        for state in states:
+            with open(state, 'rb') as fh:
+                if(fh.read(len(data)) != data):
+                    return f'{os.path.basename(state)}: flash differs from the image'
+    return None
+
+# tests that start their own host-bootloader instances
+SYSTEM_TESTS = [test_torn_upload_stays_in_bootloader, test_ports_flash_two_devices]
+
+def test_hex_extended_addresses(comdefines):
+    '''extended segment and linear address records move the records behind them, the image is cached by content'''
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    content = b'\n'.join([
+        hex_record(pagesize - 4, bytes(range(8))),
+        hex_record(0, (0x0100).to_bytes(2, 'big'), rtype=2),
+        hex_record(0x10, b'segment!'),
+        hex_record(0, (0x0001).to_bytes(2, 'big'), rtype=4),
+        hex_record(0x20, b'linear'),
+        hex_record(0x30, b'bad', checksum_error=True),
+        hex_record(0, (0x1234).to_bytes(4, 'big'), rtype=5),
+        hex_record(0, b'', rtype=1),
+        hex_record(0x40, b'after the end')])
+    (image, output) = quiet(uploader.parse_hex_image, content, pagesize, False)
+    expected = [(pagesize - 4, bytes(range(8))), (0x1010, b'segment!'), (0x10020, b'linear')]
+    if(uploader.image_ranges(image) != expected):
+        return f'ranges {[(hex(address), bytes(data)) for (address, data) in uploader.image_ranges(image)]}'
+    if(image['num_checksum_errors'] != 1 or image['start_address'] != 0x1234):
+        return 'checksum error or start address not recorded'
+
+    with tempfile.TemporaryDirectory() as tmp:
+        filename = os.path.join(tmp, 'app.hex')
+        with open(filename, 'wb') as fh:
+            fh.write(content.replace(hex_record(0x30, b'bad', checksum_error=True) + b'\n', b''))
+        (cache_dir, uploader.IMAGE_CACHE_DIR) = (uploader.IMAGE_CACHE_DIR, tmp)
+        try:
+            (parsed, output) = quiet(uploader.read_hex_image, filename, pagesize, False)
+            (cached, output) = quiet(uploader.read_hex_image, filename, pagesize, False)
+        finally:
+            uploader.IMAGE_CACHE_DIR = cache_dir
+        if('(cached)' not in output or uploader.image_ranges(cached) != uploader.image_ranges(parsed)):
+            return 'second read not served from the cache'
+    return None
+
+# tests without a bootloader
+PARSER_TESTS = [test_hex_extended_addresses]
+
+def run(binary, test, comdefines):
+    host, ser = start_host(binary, comdefines)
+    try:
+        error = test(ser, comdefines)
+        ser.write(comdefines['BL_COM_CMD_QUIT'])
+        ser.read(size=1)
+    finally:
+        ser.close()
+        host.stdout.read()
+        host.wait(timeout=5)
+    return error
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Protocol tests against the Linux build of the bootloader')
+    parser.add_argument('--binary', default=os.path.join(HOST_DIR, 'host-bootloader'), help='host bootloader executable')
+    args = parser.parse_args()
+
+    comdefines = uploader.extract_com_constants(os.path.join(HOST_DIR, '..', 'uart-bootloader', 'bootloader-communication.h'))
+    uploader.comdefines = comdefines
+
+    failed = False
+    for test in TESTS + SYSTEM_TESTS + PARSER_TESTS:
+        if(test in TESTS):
+            error = run(args.binary, test, comdefines)
+        elif(test in SYSTEM_TESTS):
+            error = test(args.binary, comdefines)
+        else:
+            error = test(comdefines)
+        print(f'{test.__name__:48} {"ok" if error is None else "FAILED: " + error}')
+        failed |= error is not None
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,154 @@
+'''
+Cycle profile of uploads to the real bootloader ELF running in simavr (sim-profile).
+
+Every scenario starts sim-profile with a fresh flash, uploads a synthetic image with uploader.py over
+the pty and reads the cycle counts when the bootloader jumps to the application. Reported per scenario:
+	- cycles per page: cycles of the whole session without rx_wait_cycles (waiting for UART data)
+	  and spm_wait_cycles (blocked on the flash), divided by the written pages
+	- the share of cycles spent waiting for data: high means link-bound, low CPU- or flash-bound
+	- inclusive cycles and calls of the tracked functions and the top functions by self cycles
+	- the time of the startup CRC check (BL_BOOT_CHECK) for a full 28 KB application, from the cycles of
+	  crc32_flash while the bootloader checks the image descriptor ('a' after the upload); they are not
+	  part of the cycles per page
+
+The cycles per page and the boot check cycles per byte are compared with baseline.json, more than
+--tolerance above the baseline fails.
+A missing baseline.json or a scenario without a baseline entry fails too, --update-baseline stores the
+current numbers (commit baseline.json with the change that caused them).
+'''
+import argparse
+import contextlib
+import io
+import json
+import os
+import subprocess
+import sys
+
+SIM_DIR = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(SIM_DIR, '..', '..', 'uploader'))
+sys.path.insert(0, os.path.join(SIM_DIR, '..', 'host'))
+import uploader
+import benchmark
+from serial import Serial
+
+# (mode, baudrate, image size in KB)
+SCENARIOS = [
+    ('hex', 115200, 4),
+    ('binary', 115200, 4),
+    ('page', 115200, 4),
+    ('page', 1000000, 4),
+    ('compressed', 1000000, 4),
+]
+
+TRACKED = ['receive_hex_record', 'handle_hex_data', 'handle_page_write', 'USART_Receive', '__vector_18', '__vector_19', 'crc32_flash']
+SPM_WAIT = ['flash_sync', 'write_flash_page', 'erase_flash_page']
+RX_WAIT = ['USART_Receive', 'USART_ReceiveTimeout']
+
+def read_symbols(elf, filename):
+    with open(filename, 'w') as fh:
+        subprocess.run(['avr-nm', '--print-size', '--defined-only', elf], stdout=fh, check=True)
+
+def run(harness, elf, symbols, mode, baudrate, image, comdefines):
+    sim = subprocess.Popen([harness, '-s', symbols, '-t', ','.join(TRACKED), '-w', ','.join(SPM_WAIT), '-r', ','.join(RX_WAIT), elf],
+        stdout=subprocess.PIPE, text=True)
+    port = sim.stdout.readline().strip()
+    # the simulation can be slower than real time
+    ser = Serial(port, comdefines['BL_COM_BAUD_0'], timeout=60)
+    args = argparse.Namespace(verbose=False, replace=False, flow='none', app_version=0)
+    uploader.comdefines = comdefines
+
+    try:
+        with contextlib.redirect_stdout(io.StringIO()):
+            upload(ser, mode, baudrate, image, comdefines, args)
+    finally:
+        ser.close()
+
+    result = json.loads(sim.stdout.readline())
+    sim.wait()
+    return result
+
+def upload(ser, mode, baudrate, image, comdefines, args):
+    if(baudrate != comdefines['BL_COM_BAUD_0']):
+        ser.baudrate = uploader.switch_baudrate(ser, baudrate, comdefines, args)
+    if(mode == 'hex'):
+        uploader.upload_program(ser, image, comdefines, args)
+    elif(mode == 'binary'):
+        uploader.upload_program_binary(ser, image, comdefines, args)
+    elif(mode == 'compressed'):
+        uploader.upload_program_pages(ser, image, comdefines, args, compressed=True)
+    else:
+        uploader.upload_program_pages(ser, image, comdefines, args)
+    uploader.mark_application_valid(ser, image, comdefines, args)
+    ser.write(comdefines['BL_COM_CMD_QUIT'])
+    ser.read(size=1)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Cycle profile of uploads to the bootloader in simavr')
+    parser.add_argument('--elf', default=os.path.join(SIM_DIR, '..', 'uart-bootloader', 'build', 'uart-bootloader.elf'))
+    parser.add_argument('--harness', default=os.path.join(SIM_DIR, 'sim-profile'))
+    parser.add_argument('--baseline', default=os.path.join(SIM_DIR, 'baseline.json'))
+    parser.add_argument('--update-baseline', action='store_true', help='store the results as the new baseline')
+    parser.add_argument('--tolerance', type=float, default=0.02, help='allowed increase of the cycles per page')
+    parser.add_argument('--top', type=int, default=8, help='number of functions listed by self cycles')
+    args = parser.parse_args()
+
+    baseline = {}
+    if(os.path.exists(args.baseline)):
+        with open(args.baseline, 'r') as fh:
+            baseline = json.load(fh)
+    elif(not args.update_baseline):
+        print(f'Error: no baseline ({os.path.relpath(args.baseline)}), run with --update-baseline (make baseline) to create it')
+        sys.exit(1)
+
+    comdefines = uploader.extract_com_constants(os.path.join(SIM_DIR, '..', 'uart-bootloader', 'bootloader-communication.h'))
+    symbols = os.path.join(os.path.dirname(args.elf), 'symbols.txt')
+    read_symbols(args.elf, symbols)
+
+    results = {}
+    failed = False
+    for (mode, baudrate, size_kb) in SCENARIOS:
+        name = f'{mode}-{baudrate}-{size_kb}k'
+        image = dict(benchmark.synthetic_image(size_kb, comdefines['BL_COM_PAGESIZE']), bootloader_start_address=benchmark.BOOTLOADER_START)
+        result = run(args.harness, args.elf, symbols, mode, baudrate, image, comdefines)
+
+        crc_cycles = result['tracked']['crc32_flash']['inclusive']
+        busy = result['cycles'] - result['rx_wait_cycles'] - result['spm_wait_cycles'] - crc_cycles
+        cycles_per_page = busy / max(result['pages_written'], 1)
+        crc_cycles_per_byte = crc_cycles / (size_kb * 1024)
+        rx_share = 100 * result['rx_wait_cycles'] / result['cycles']
+        results[name] = {'cycles_per_page': round(cycles_per_page), 'boot_check_cycles_per_byte': round(crc_cycles_per_byte, 1), 'profile': result}
+
+        print()
+        print(f'{name}: {result["cycles"]} cycles, {result["pages_written"]} pages, {cycles_per_page:.0f} cycles per page')
+        print(f'\twaiting for UART data: {rx_share:.1f}% ({"link-bound" if rx_share > 50 else "CPU- or flash-bound"})')
+        print(f'\tSPM busy: {result["spm_busy_cycles"]} cycles, blocked on it: {result["spm_wait_cycles"]} cycles')
+        print(f'\tboot check: {crc_cycles_per_byte:.1f} cycles per byte, {crc_cycles_per_byte * 28 * 1024 / 16000:.1f} ms for 28 KB at 16 MHz')
+        for (function, counts) in result['tracked'].items():
+            print(f'\t{function:24} {counts["inclusive"]:12} inclusive {counts["self"]:12} self {counts["calls"]:8} calls')
+        top = sorted(result['self'].items(), key=lambda item: item[1], reverse=True)[:args.top]
+        print('\ttop self: ' + ', '.join(f'{function} {100 * cycles / result["cycles"]:.1f}%' for (function, cycles) in top))
+
+        if(args.update_baseline):
+            continue
+        if(name not in baseline):
+            print(f'\tNO BASELINE for {name}, run with --update-baseline')
+            failed = True
+            continue
+        limit = baseline[name]['cycles_per_page'] * (1 + args.tolerance)
+        if(cycles_per_page > limit):
+            print(f'\tREGRESSION: {cycles_per_page:.0f} cycles per page, baseline {baseline[name]["cycles_per_page"]}')
+            failed = True
+        if('boot_check_cycles_per_byte' not in baseline[name]):
+            print(f'\tNO BOOT CHECK BASELINE for {name}, run with --update-baseline')
+            failed = True
+        elif(crc_cycles_per_byte > baseline[name]['boot_check_cycles_per_byte'] * (1 + args.tolerance)):
+            print(f'\tREGRESSION: boot check {crc_cycles_per_byte:.1f} cycles per byte, baseline {baseline[name]["boot_check_cycles_per_byte"]}')
+            failed = True
+
+    if(args.update_baseline):
+        with open(args.baseline, 'w') as fh:
+            json.dump({name: {key: result[key] for key in ['cycles_per_page', 'boot_check_cycles_per_byte']} for (name, result) in results.items()}, fh, indent=2)
+            fh.write('\n')
+        print(f'Baseline written to {os.path.relpath(args.baseline)}')
+
+    sys.exit(1 if failed else 0)
@@ -0,0 +1,364 @@
+/*
+ * sim-profile.c
+ *
+ * Runs the bootloader ELF in simavr (ATmega328P, 16 MHz) with UART0 bridged to a pty and counts
+ * where the cycles go until the bootloader jumps to the application:
+ *	- self cycles per function (flat profile, symbols from avr-nm --print-size)
+ *	- inclusive cycles and calls for the tracked functions (-t), counted from the entry until the
+ *	  return address is popped again, interrupts that hit in between are included
+ *	- SPM: page erase / write keep SPMEN set for SPM_US like the real flash, spm_wait_cycles are the
+ *	  cycles of that busy time spent in the wait functions (-w)
+ *	- rx_wait_cycles: self cycles of the receive functions (-r), mostly their loop waiting for the next byte
+ * Prints the pty path on the first line and the results as one JSON line at the end.
+ *
+ * usage: sim-profile [-s symbols.txt] [-t f1,f2] [-w f1,f2] [-r f1,f2] bootloader.elf
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_uart.h>
+
+#define F_CPU 16000000
+#define BL_SECTIONSTART 0x7000
+#define VECTORS_SIZE (26 * 4)
+
+// page erase / write time (datasheet: 3.7 - 4.5 ms)
+#define SPM_US 4000
+#define SPM_CYCLES ((uint64_t) F_CPU / 1000000 * SPM_US)
+#define SPM_OPCODE 0x95E8
+
+// data space addresses
+#define SPL 0x5D
+#define SPH 0x5E
+#define MCUCR 0x55
+#define SPMCSR 0x57
+#define IVSEL 1
+#define SPMEN 0
+#define PGERS 1
+#define PGWRT 2
+
+#define MAX_SYMBOLS 512
+#define MAX_TRACKED 16
+
+typedef struct {
+	char name[64];
+	uint32_t start, end;
+	uint64_t self;
+	uint8_t flags;
+} symbol_t;
+
+#define SYMBOL_WAIT 1
+#define SYMBOL_RX 2
+
+typedef struct {
+	symbol_t* symbol;
+	uint16_t sp; // 0: not active
+	uint64_t inclusive;
+	uint32_t calls;
+} tracked_t;
+
+symbol_t symbols[MAX_SYMBOLS];
+int num_symbols = 0;
+tracked_t tracked[MAX_TRACKED];
+int num_tracked = 0;
+
+int pty_fd = -1;
+uint8_t uart_xon = 1;
+uint32_t uart_bytes_in = 0, uart_bytes_out = 0;
+avr_irq_t* uart_in;
+
+uint64_t spm_busy_until = 0;
+uint64_t spm_busy_cycles = 0, spm_wait_cycles = 0, rx_wait_cycles = 0;
+uint32_t pages_erased = 0, pages_written = 0;
+
+static int compare_symbols(const void* a, const void* b) {
+	return ((const symbol_t*) a)->start - ((const symbol_t*) b)->start;
+}
+
+// avr-nm --print-size --defined-only: "<addr> <size> <type> <name>", only code symbols are kept
+static void read_symbols(const char* filename) {
+	FILE* fh = fopen(filename, "r");
+	if(fh == NULL) {
+		perror(filename);
+		exit(1);
+	}
+
+	char line[128];
+	while(num_symbols < MAX_SYMBOLS && fgets(line, sizeof(line), fh)) {
+		unsigned addr, size;
+		char type, name[64];
+		// symbols without a size (e.g. __vectors) have one column less and are skipped
+		if(sscanf(line, "%x %x %c %63s", &addr, &size, &type, name) != 4)
+			continue;
+		if(type != 't' && type != 'T' && type != 'W')
+			continue;
+		strcpy(symbols[num_symbols].name, name);
+		symbols[num_symbols].start = addr;
+		symbols[num_symbols].end = addr + size;
+		num_symbols++;
+	}
+	fclose(fh);
+	qsort(symbols, num_symbols, sizeof(symbol_t), compare_symbols);
+}
+
+static symbol_t* find_symbol(uint32_t pc) {
+	int lo = 0, hi = num_symbols - 1;
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(pc < symbols[mid].start)
+			hi = mid - 1;
+		else if(pc >= symbols[mid].end)
+			lo = mid + 1;
+		else
+			return &symbols[mid];
+	}
+	return NULL;
+}
+
+static symbol_t* find_symbol_by_name(const char* name) {
+	for(int i = 0; i < num_symbols; i++) {
+		if(strcmp(symbols[i].name, name) == 0)
+			return &symbols[i];
+	}
+	return NULL;
+}
+
+// comma separated function names: tracked (flags 0) or marked with flags
+static void select_symbols(char* list, uint8_t flags) {
+	for(char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		symbol_t* symbol = find_symbol_by_name(name);
+		if(symbol == NULL) {
+			fprintf(stderr, "sim-profile: %s not found (inlined?)\n", name);
+		} else if(flags) {
+			symbol->flags |= flags;
+		} else if(num_tracked < MAX_TRACKED) {
+			tracked[num_tracked++].symbol = symbol;
+		}
+	}
+}
+
+static void uart_out_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	uint8_t c = value;
+	if(write(pty_fd, &c, 1) == 1)
+		uart_bytes_out++;
+}
+
+static void uart_xon_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	uart_xon = 1;
+}
+
+static void uart_xoff_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	uart_xon = 0;
+}
+
+// hands the bytes of the uploader to the simulated UART while its input fifo has space,
+// returns 1 once the uploader closed the port
+static uint8_t uart_feed() {
+	uint8_t c;
+	struct pollfd pfd = { pty_fd, POLLIN, 0 };
+	while(uart_xon && poll(&pfd, 1, 0) > 0) {
+		if(!(pfd.revents & POLLIN))
+			return uart_bytes_in > 0 && (pfd.revents & POLLHUP);
+		if(read(pty_fd, &c, 1) != 1)
+			return 1;
+		avr_raise_irq(uart_in, c);
+		uart_bytes_in++;
+	}
+	return 0;
+}
+
+// closing the master discards what the uploader didn't read yet, so wait until it closes the port
+static void close_pty(int timeout_ms) {
+	struct pollfd pfd = { pty_fd, 0, 0 };
+	for(; timeout_ms > 0; timeout_ms -= 10) {
+		if(poll(&pfd, 1, 10) > 0 && (pfd.revents & POLLHUP))
+			break;
+	}
+	close(pty_fd);
+}
+
+static const char* open_pty() {
+	pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(pty_fd < 0 || grantpt(pty_fd) || unlockpt(pty_fd))
+		return NULL;
+
+	struct termios tio;
+	tcgetattr(pty_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(pty_fd, TCSANOW, &tio);
+	return ptsname(pty_fd);
+}
+
+static uint16_t get_sp(avr_t* avr) {
+	return avr->data[SPL] | (avr->data[SPH] << 8);
+}
+
+static void print_results(avr_t* avr) {
+	printf("{\"cycles\": %llu, \"rx_wait_cycles\": %llu, \"spm_busy_cycles\": %llu, \"spm_wait_cycles\": %llu, ",
+		(unsigned long long) avr->cycle, (unsigned long long) rx_wait_cycles,
+		(unsigned long long) spm_busy_cycles, (unsigned long long) spm_wait_cycles);
+	printf("\"pages_erased\": %u, \"pages_written\": %u, \"bytes_in\": %u, \"bytes_out\": %u, ",
+		pages_erased, pages_written, uart_bytes_in, uart_bytes_out);
+
+	printf("\"tracked\": {");
+	for(int i = 0; i < num_tracked; i++) {
+		printf("%s\"%s\": {\"inclusive\": %llu, \"self\": %llu, \"calls\": %u}", i ? ", " : "", tracked[i].symbol->name,
+			(unsigned long long) tracked[i].inclusive, (unsigned long long) tracked[i].symbol->self, tracked[i].calls);
+	}
+
+	printf("}, \"self\": {");
+	int first = 1;
+	for(int i = 0; i < num_symbols; i++) {
+		if(symbols[i].self == 0)
+			continue;
+		printf("%s\"%s\": %llu", first ? "" : ", ", symbols[i].name, (unsigned long long) symbols[i].self);
+		first = 0;
+	}
+	printf("}}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+	char* tracked_list = NULL;
+	char* wait_list = NULL;
+	char* rx_list = NULL;
+	const char* symbol_file = NULL;
+	const char* elf_file = NULL;
+
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			symbol_file = argv[++i];
+		else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			tracked_list = argv[++i];
+		else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			wait_list = argv[++i];
+		else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			rx_list = argv[++i];
+		else
+			elf_file = argv[i];
+	}
+	if(elf_file == NULL) {
+		fprintf(stderr, "usage: %s [-s symbols.txt] [-t f1,f2] [-w f1,f2] [-r f1,f2] bootloader.elf\n", argv[0]);
+		return 1;
+	}
+
+	if(symbol_file) {
+		read_symbols(symbol_file);
+		if(tracked_list)
+			select_symbols(tracked_list, 0);
+		if(wait_list)
+			select_symbols(wait_list, SYMBOL_WAIT);
+		if(rx_list)
+			select_symbols(rx_list, SYMBOL_RX);
+	}
+
+	elf_firmware_t firmware = {{0}};
+	if(elf_read_firmware(elf_file, &firmware)) {
+		fprintf(stderr, "sim-profile: can't read %s\n", elf_file);
+		return 1;
+	}
+
+	avr_t* avr = avr_make_mcu_by_name("atmega328p");
+	if(avr == NULL)
+		return 1;
+	avr_init(avr);
+	avr->frequency = F_CPU;
+	avr_load_firmware(avr, &firmware);
+
+	// BOOTRST programmed: reset starts the boot section
+	avr->reset_pc = BL_SECTIONSTART;
+	avr->pc = BL_SECTIONSTART;
+
+	// the bytes go to the pty only, not to stdout
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_out_hook, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uart_xon_hook, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uart_xoff_hook, NULL);
+
+	const char* port = open_pty();
+	if(port == NULL) {
+		perror("pty");
+		return 1;
+	}
+	printf("%s\n", port);
+	fflush(stdout);
+
+	uint32_t steps = 0;
+	while(1) {
+		uint32_t pc = avr->pc;
+		uint64_t cycle = avr->cycle;
+		uint8_t spmcsr = avr->data[SPMCSR];
+		uint8_t is_spm = (avr->flash[pc] | (avr->flash[pc + 1] << 8)) == SPM_OPCODE;
+
+		int state = avr_run(avr);
+		if(state == cpu_Done || state == cpu_Crashed)
+			break;
+
+		// simavr doesn't know IVSEL, interrupts of the bootloader are redirected to its vector table
+		if((avr->data[MCUCR] & (1<<IVSEL)) && avr->pc < VECTORS_SIZE)
+			avr->pc += BL_SECTIONSTART;
+
+		// the bootloader quit and jumped to the application
+		if(avr->pc < BL_SECTIONSTART && !(avr->data[MCUCR] & (1<<IVSEL)))
+			break;
+
+		uint64_t delta = avr->cycle - cycle;
+		symbol_t* symbol = find_symbol(pc);
+		if(symbol) {
+			symbol->self += delta;
+			if(symbol->flags & SYMBOL_RX)
+				rx_wait_cycles += delta;
+		}
+
+		if(is_spm && (spmcsr & ((1<<PGERS) | (1<<PGWRT)))) {
+			spm_busy_until = avr->cycle + SPM_CYCLES;
+			if(spmcsr & (1<<PGERS))
+				pages_erased++;
+			else
+				pages_written++;
+		}
+		if(avr->cycle < spm_busy_until) {
+			avr->data[SPMCSR] |= (1<<SPMEN);
+			spm_busy_cycles += delta;
+			if(symbol && (symbol->flags & SYMBOL_WAIT))
+				spm_wait_cycles += delta;
+		} else if(spm_busy_until) {
+			avr->data[SPMCSR] &= ~(1<<SPMEN);
+			spm_busy_until = 0;
+		}
+
+		uint16_t sp = get_sp(avr);
+		for(int i = 0; i < num_tracked; i++) {
+			tracked_t* t = &tracked[i];
+			if(t->sp) {
+				t->inclusive += delta;
+				if(sp > t->sp)
+					t->sp = 0;
+			} else if(avr->pc == t->symbol->start) {
+				// recursive calls are part of the outermost one
+				t->sp = sp;
+				t->calls++;
+			}
+		}
+
+		if((++steps & 0xFF) == 0 && uart_feed())
+			break;
+	}
+
+	close_pty(2000);
+	print_results(avr);
+	return 0;
+}
@@ -17,6 +17,7 @@
 #include <avr/interrupt.h>
 #include <stdlib.h>
 #include <avr/pgmspace.h>
+#include <util/delay.h>
 
 #ifndef BAUDRATE // allow custom baudrate
 #define BAUDRATE 9600
@@ -24,34 +25,267 @@
 
 #define BAUD_CONST (((F_CPU/(BAUDRATE*16UL)))-1)
 
+// rounded UBRR values for normal and double speed (U2X) mode
+#define USART_UBRR(baud) (((F_CPU) + 8UL*(baud)) / (16UL*(baud)) - 1)
+#define USART_UBRR_U2X(baud) (((F_CPU) + 4UL*(baud)) / (8UL*(baud)) - 1)
+
 #ifndef RX_BUFFERSIZE
 #define RX_BUFFERSIZE 128
 #endif // RX_BUFFERSIZE
 
+// the ring indices wrap with a mask, rxBufferFree has to hold RX_BUFFERSIZE
+#if (RX_BUFFERSIZE & (RX_BUFFERSIZE - 1)) || RX_BUFFERSIZE > 128
+#error "RX_BUFFERSIZE has to be a power of two of at most 128"
+#endif
+#define RX_BUFFERMASK (RX_BUFFERSIZE - 1)
+
+// transmitted bytes are queued and sent from the UDRE interrupt
+#ifndef TX_BUFFERSIZE
+#define TX_BUFFERSIZE 32
+#endif // TX_BUFFERSIZE
+
+#if (TX_BUFFERSIZE & (TX_BUFFERSIZE - 1)) || TX_BUFFERSIZE > 128
+#error "TX_BUFFERSIZE has to be a power of two of at most 128"
+#endif
+#define TX_BUFFERMASK (TX_BUFFERSIZE - 1)
+
+// called while waiting for received data, e.g. to keep background work going
+#ifndef USART_RX_IDLE
+#define USART_RX_IDLE()
+#endif // USART_RX_IDLE
+
 #define RX_FREE_XOFF 4
 #define RX_FREE_XON 16
 #define XON 0x11
 #define XOFF 0x13
 
+/*
+	Flow control, selected at runtime with USART_SetFlowControl():
+	- NONE: nothing is sent or watched (default)
+	- XONXOFF: XOFF / XON are sent when the RX buffer runs full / has room again, only for ASCII protocols
+	- RTSCTS: RTS output (low = send) follows the RX buffer, the UDRE interrupt holds back data while CTS is high.
+	  Needs USART_RTS_DDRX / _DDRXn / _PORTX / _PORTXn, CTS is optional (USART_CTS_PINX / _PINXn / _PORTX / _PORTXn)
+	- CREDIT: nothing on the line, the protocol tells the sender how much it may send (USART_RXConsumed())
+	USART_NO_FLOWCONTROL compiles it out, the mode stays NONE
+	
+	USART_POLLED leaves out the ring buffers and both interrupts for the smallest builds: received bytes are read
+	from UDR0 when they are taken (the USART holds two more), sending waits for UDRE0. No flow control.
+*/
+#define USART_FLOW_NONE 0
+#define USART_FLOW_XONXOFF 1
+#define USART_FLOW_RTSCTS 2
+#define USART_FLOW_CREDIT 3
+
 #define ASCII_CR 0x0d
 #define ASCII_LF 0x0a
 
 #define USART_AwaitTX() {while(!(UCSR0A & (1<<UDRE0))) {}}
 
+#ifdef USART_POLLED
+#define USART_NO_FLOWCONTROL
+#define usart_rx_empty() (!(UCSR0A & (1<<RXC0)))
+#define usart_tx_poll()
+#else
+// start == end is also a full buffer, which credit based flow control allows
+#define usart_rx_empty() (rxBufferFree == RX_BUFFERSIZE)
+
 volatile char rxBuffer[RX_BUFFERSIZE];
 volatile uint8_t rxBufferStart = 0, rxBufferEnd = 0, rxBufferFree = RX_BUFFERSIZE, rxStatus = 1;
+volatile uint8_t rxConsumed = 0; // bytes taken from the buffer, wraps
+#ifdef USART_NO_FLOWCONTROL
+#define usartFlowControl USART_FLOW_NONE
+#else
+volatile uint8_t usartFlowControl = USART_FLOW_NONE;
+#endif // USART_NO_FLOWCONTROL
+
+volatile char txBuffer[TX_BUFFERSIZE];
+volatile uint8_t txBufferStart = 0, txBufferEnd = 0;
+volatile char txFlow = 0; // XON / XOFF to send ahead of the queued bytes
+volatile uint8_t txStalled = 0; // the UDRE interrupt stopped because CTS is high
+#endif // USART_POLLED
+volatile uint8_t txActive = 0; // a byte was written to UDR0 since the last USART_Flush()
+volatile uint8_t rxOverrun = 0; // received bytes were dropped, see USART_Overrun()
 
 void USART_Init(){
 	UBRR0H = (BAUD_CONST >> 8);
 	UBRR0L = BAUD_CONST;
 	UCSR0B |= (1<<RXEN0)|(1<<TXEN0);
 	
+#ifndef USART_POLLED
 	UCSR0B |= (1<<RXCIE0);
+#endif // USART_POLLED
+}
+
+static inline void usart_write_udr(char data) {
+	UDR0 = data;
+	UCSR0A = (UCSR0A & ((1<<U2X0) | (1<<MPCM0))) | (1<<TXC0); // clear TXC0, set again when the line is idle
+	txActive = 1;
+}
+
+#ifndef USART_POLLED
+#ifdef USART_CTS_PINX
+#define usart_cts_stop() (usartFlowControl == USART_FLOW_RTSCTS && (USART_CTS_PINX & (1<<USART_CTS_PINXn)))
+#else
+#define usart_cts_stop() 0
+#endif // USART_CTS_PINX
+
+// moves the next byte into UDR0, called from the UDRE interrupt or with interrupts disabled once UDRE0 is set
+static inline void usart_tx_next() {
+	if(usart_cts_stop() && (txFlow || txBufferStart != txBufferEnd)) {
+		// restarted by usart_tx_poll() once CTS is low again
+		UCSR0B &= ~(1<<UDRIE0);
+		txStalled = 1;
+	} else if(txFlow) {
+		usart_write_udr(txFlow);
+		txFlow = 0;
+	} else if(txBufferStart != txBufferEnd) {
+		usart_write_udr(txBuffer[txBufferStart]);
+		txBufferStart = (txBufferStart + 1) & TX_BUFFERMASK;
+	} else {
+		UCSR0B &= ~(1<<UDRIE0);
+	}
+}
+
+ISR(USART_UDRE_vect) {
+	usart_tx_next();
+}
+
+// called from the waiting loops, CTS has no interrupt of its own
+static inline void usart_tx_poll() {
+	if(txStalled && !usart_cts_stop()) {
+		uint8_t sreg = SREG;
+		cli();
+		txStalled = 0;
+		UCSR0B |= (1<<UDRIE0);
+		SREG = sreg;
+	}
 }
 
+// stops / restarts the sender when the RX buffer runs full / has room again, interrupts have to be disabled
+static inline void usart_rx_pause() {
+	if(usartFlowControl == USART_FLOW_XONXOFF) {
+		// sent by the UDRE interrupt ahead of the queue, the RX interrupt doesn't wait for the line
+		txFlow = XOFF;
+		UCSR0B |= (1<<UDRIE0);
+	}
+#ifdef USART_RTS_PORTX
+	if(usartFlowControl == USART_FLOW_RTSCTS)
+		USART_RTS_PORTX |= (1<<USART_RTS_PORTXn);
+#endif // USART_RTS_PORTX
+	rxStatus = 0;
+}
+
+static inline void usart_rx_resume() {
+	if(usartFlowControl == USART_FLOW_XONXOFF) {
+		txFlow = XON;
+		UCSR0B |= (1<<UDRIE0);
+	}
+#ifdef USART_RTS_PORTX
+	if(usartFlowControl == USART_FLOW_RTSCTS)
+		USART_RTS_PORTX &= ~(1<<USART_RTS_PORTXn);
+#endif // USART_RTS_PORTX
+	rxStatus = 1;
+}
+
+#ifndef USART_NO_FLOWCONTROL
+// returns 1 if the mode is not available (RTS/CTS without RTS pin)
+uint8_t USART_SetFlowControl(uint8_t mode) {
+	if(mode > USART_FLOW_CREDIT)
+		return 1;
+#ifdef USART_RTS_PORTX
+	if(mode == USART_FLOW_RTSCTS) {
+		USART_RTS_PORTX &= ~(1<<USART_RTS_PORTXn); // ready
+		USART_RTS_DDRX |= (1<<USART_RTS_DDRXn);
+#ifdef USART_CTS_PINX
+		USART_CTS_PORTX |= (1<<USART_CTS_PORTXn); // pullup, an open CTS stops the output
+#endif // USART_CTS_PINX
+	}
+#else
+	if(mode == USART_FLOW_RTSCTS)
+		return 1;
+#endif // USART_RTS_PORTX
+	
+	uint8_t sreg = SREG;
+	cli();
+	usartFlowControl = mode;
+	rxStatus = 1;
+	txStalled = 0;
+	UCSR0B |= (1<<UDRIE0);
+	SREG = sreg;
+	return 0;
+}
+#endif // USART_NO_FLOWCONTROL
+
+// the sender may have sent up to USART_RXConsumed() + RX_BUFFERSIZE bytes (mod 256) without overrunning the buffer
+static inline uint8_t USART_RXConsumed() {
+	return rxConsumed;
+}
+
+// without interrupts (e.g. in the application) the queue is sent by polling UDRE0
+static void usart_tx_drain_polled() {
+	while(txFlow || txBufferStart != txBufferEnd) {
+		if(UCSR0A & (1<<UDRE0))
+			usart_tx_next();
+	}
+}
+
+// queues a byte, only waits if the buffer is full
 void USART_Transmit(char data){
+	if(!(SREG & (1<<SREG_I))) {
+		usart_tx_drain_polled();
+		USART_AwaitTX();
+		usart_write_udr(data);
+		return;
+	}
+
+	uint8_t next = (txBufferEnd + 1) & TX_BUFFERMASK;
+	while(next == txBufferStart)
+		usart_tx_poll();
+	txBuffer[txBufferEnd] = data;
+
+	uint8_t sreg = SREG;
+	cli();
+	txBufferEnd = next;
+	UCSR0B |= (1<<UDRIE0);
+	SREG = sreg;
+}
+
+// wait until every queued byte has left the shift register, e.g. before quitting or changing the baudrate
+void USART_Flush() {
+	if(SREG & (1<<SREG_I)) {
+		while(txFlow || txBufferStart != txBufferEnd)
+			usart_tx_poll();
+	} else {
+		usart_tx_drain_polled();
+	}
+	if(txActive)
+		while(!(UCSR0A & (1<<TXC0))) ;
+	txActive = 0;
+}
+#else
+// nothing is queued, UDR0 is written as soon as it is empty
+void USART_Transmit(char data) {
 	USART_AwaitTX();
-	UDR0 = data;
+	usart_write_udr(data);
+}
+
+// wait until the last byte has left the shift register
+void USART_Flush() {
+	if(txActive)
+		while(!(UCSR0A & (1<<TXC0))) ;
+	txActive = 0;
+}
+#endif // USART_POLLED
+
+void USART_TransmitAndDrain(char data) {
+	USART_Transmit(data);
+	USART_Flush();
+}
+
+void USART_SetBaud(uint16_t ubrr, uint8_t double_speed) {
+	UBRR0H = (ubrr >> 8);
+	UBRR0L = ubrr;
+	UCSR0A = double_speed ? (1<<U2X0) : 0;
 }
 
 void USART_TransmitMultiple(char* data, uint8_t len) {
@@ -59,30 +293,38 @@ void USART_TransmitMultiple(char* data, uint8_t len) {
 		USART_Transmit(data[i]);
 }
 
+#ifndef USART_POLLED
 ISR(USART_RX_vect) {
+	if(rxBufferFree == 0) {
+		// the sender ignored the flow control (or there is none), the byte has to be read to clear the interrupt
+		uint8_t dropped = UDR0;
+		(void) dropped;
+		rxOverrun = 1;
+		return;
+	}
 	rxBuffer[rxBufferEnd] = UDR0;
-	rxBufferEnd = (rxBufferEnd + 1) % RX_BUFFERSIZE;
+	rxBufferEnd = (rxBufferEnd + 1) & RX_BUFFERMASK;
 	
 	rxBufferFree -= 1;
-	if(rxStatus && (rxBufferFree <= RX_FREE_XOFF || rxBufferFree == 0)) {
-		USART_Transmit(XOFF);
-		rxStatus = 0;
-	}
+	if(rxStatus && rxBufferFree <= RX_FREE_XOFF)
+		usart_rx_pause();
 }
 
 char USART_Receive(){
 	char rx;
-	while(rxBufferStart == rxBufferEnd) ;
+	while(usart_rx_empty()) {
+		USART_RX_IDLE();
+		usart_tx_poll();
+	}
 	
 	cli();
 	rx = rxBuffer[rxBufferStart];
-	rxBufferStart = (rxBufferStart + 1) % RX_BUFFERSIZE;
+	rxBufferStart = (rxBufferStart + 1) & RX_BUFFERMASK;
+	rxConsumed++;
 	
 	rxBufferFree += 1;
-	if(!rxStatus && (rxBufferFree >= RX_FREE_XON || rxBufferFree >= RX_BUFFERSIZE)) {
-		USART_Transmit(XON);
-		rxStatus = 1;
-	}
+	if(!rxStatus && rxBufferFree >= RX_FREE_XON)
+		usart_rx_resume();
 	
 	sei();
 	
@@ -91,14 +333,132 @@ char USART_Receive(){
 	return rx;
 }
 
-inline void USART_ReceiveMultiple(char* buffer, uint8_t bufsize) {
+/*
+	Block receive without copying: waits for data and points *span to the oldest received byte in rxBuffer.
+	Returns how many bytes follow it in one piece (at most max, the span ends at the end of the ring).
+	The bytes stay in the buffer until they are released with USART_ReceiveCommit().
+*/
+uint8_t USART_ReceiveSpan(uint8_t** span, uint8_t max) {
+	uint8_t available;
+	while((available = RX_BUFFERSIZE - rxBufferFree) == 0) {
+		USART_RX_IDLE();
+		usart_tx_poll();
+	}
+	
+	uint8_t start = rxBufferStart;
+	uint8_t len = RX_BUFFERSIZE - start;
+	if(len > available)
+		len = available;
+	if(len > max)
+		len = max;
+	
+	*span = (uint8_t*) rxBuffer + start;
+	return len;
+}
+
+// releases len bytes returned by USART_ReceiveSpan()
+void USART_ReceiveCommit(uint8_t len) {
+	uint8_t sreg = SREG;
+	cli();
+	rxBufferStart = (rxBufferStart + len) & RX_BUFFERMASK;
+	rxConsumed += len;
+	
+	rxBufferFree += len;
+	if(!rxStatus && rxBufferFree >= RX_FREE_XON)
+		usart_rx_resume();
+	SREG = sreg;
+}
+#else
+char USART_Receive() {
+	while(usart_rx_empty())
+		USART_RX_IDLE();
+	// the USART lost a byte before this one
+	if(UCSR0A & (1<<DOR0))
+		rxOverrun = 1;
+	return UDR0;
+}
+
+// one byte per span, taken from UDR0 right away
+uint8_t rxSpanByte;
+uint8_t USART_ReceiveSpan(uint8_t** span, uint8_t max) {
+	rxSpanByte = USART_Receive();
+	*span = &rxSpanByte;
+	return 1;
+}
+
+#define USART_ReceiveCommit(len) ((void) (len))
+#endif // USART_POLLED
+
+void USART_ReceiveMultiple(char* buffer, uint8_t bufsize) {
+	while(bufsize > 0) {
+		uint8_t* span;
+		uint8_t len = USART_ReceiveSpan(&span, bufsize);
+		for(uint8_t i = 0; i < len; i++)
+			buffer[i] = span[i];
+		USART_ReceiveCommit(len);
+		buffer += len;
+		bufsize -= len;
+	}
+}
+
+// returns 1 if received bytes were lost since the last call (the buffer was full), clears the flag
+uint8_t USART_Overrun() {
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t overrun = rxOverrun;
+	rxOverrun = 0;
+	SREG = sreg;
+	return overrun;
+}
+
+#define USART_TICKS_PER_MS 10
+
+// waits for a byte without taking it from the buffer, the wait is taken from *ticks (100 us each)
+// so several calls can share one deadline, returns 1 once the ticks are used up
+uint8_t USART_AwaitRXTicks(uint16_t* ticks) {
+	while(usart_rx_empty()) {
+		if(*ticks == 0)
+			return 1;
+		(*ticks)--;
+		USART_RX_IDLE();
+		usart_tx_poll();
+		_delay_us(100);
+	}
+	return 0;
+}
+
+// waits for a byte without taking it from the buffer, returns 1 if none arrived within timeout_ms (max. 6553 ms)
+uint8_t USART_AwaitRX(uint16_t timeout_ms) {
+	uint16_t ticks = timeout_ms * USART_TICKS_PER_MS;
+	return USART_AwaitRXTicks(&ticks);
+}
+
+// returns 1 if no byte arrived within timeout_ms (max. 6553 ms)
+uint8_t USART_ReceiveTimeout(char* data, uint16_t timeout_ms) {
+	if(USART_AwaitRX(timeout_ms))
+		return 1;
+	
+	*data = USART_Receive();
+	return 0;
+}
+
+// timeout_ms applies to every single byte, returns 1 on timeout
+uint8_t USART_ReceiveMultipleTimeout(char* buffer, uint8_t bufsize, uint16_t timeout_ms) {
 	for(uint8_t i = 0; i < bufsize; i++) {
-		buffer[i] = USART_Receive();
+		if(USART_ReceiveTimeout(buffer + i, timeout_ms))
+			return 1;
 	}
+	return 0;
+}
+
+// drop received bytes until the line was idle for idle_ms
+void USART_DiscardRX(uint16_t idle_ms) {
+	char dummy;
+	while(!USART_ReceiveTimeout(&dummy, idle_ms)) ;
 }
 
 inline uint8_t USART_IsRXBufferEmpty() {
-	return rxBufferFree == RX_BUFFERSIZE ? 1 : 0;
+	return usart_rx_empty() ? 1 : 0;
 }
 
 void USART_TransmitString(const char dataarr[]) {
@@ -16,6 +16,22 @@
 #define BL_COM_CMD_INFO 'i'
 #define BL_COM_CMD_UPLOAD 'u'
 #define BL_COM_CMD_VERIFY 'v'
+#define BL_COM_CMD_UPLOADBINARY 'b'
+#define BL_COM_CMD_PAGEWRITE 'p'
+#define BL_COM_CMD_PAGEWRITECOMPRESSED 'z'
+#define BL_COM_CMD_UPLOADWINDOWED 'w'
+#define BL_COM_CMD_PAGECRCS 'c'
+#define BL_COM_CMD_VERIFYCRC 'h'
+#define BL_COM_CMD_DUMP 'd'
+#define BL_COM_CMD_SETBAUD 'B'
+#define BL_COM_CMD_UPLOADMODE 'm'
+#define BL_COM_CMD_ERASE 'e'
+#define BL_COM_CMD_FLOWCONTROL 'F'
+#define BL_COM_CMD_EEPROMWRITE 'E'
+#define BL_COM_CMD_EEPROMCRC 'H'
+#define BL_COM_CMD_EEPROMDUMP 'D'
+#define BL_COM_CMD_SYNC 's'
+#define BL_COM_CMD_APPVALID 'a'
 
 #define BL_COM_REPLY_STATUSMASK 0b01110000
 #define BL_COM_REPLY_OK (7<<4)
@@ -23,6 +39,10 @@
 #define BL_COM_REPLY_QUITTING (5<<4)
 #define BL_COM_REPLY_NOTIMPLEMENTEDYET (4<<4)
 #define BL_COM_REPLY_UPLOADERROR (3<<4)
+#define BL_COM_REPLY_INVALIDARG (2<<4)
+// sent instead of the reply to a command if received bytes were lost before it (RX buffer full), the input is
+// discarded until the line is idle for BL_COM_UPLOAD_DISCARDTIMEOUT_MS
+#define BL_COM_REPLY_RXOVERRUN (1<<4)
 
 
 #define BL_COM_UPLOADINFO_MASK 0b00001111
@@ -32,9 +52,121 @@
 #define BL_COM_UPLOADERR_HEXVAL_16 3
 #define BL_COM_UPLOADERR_LINELEN 4
 #define BL_COM_UPLOADERR_CHECKSUM 5
+#define BL_COM_UPLOADERR_ADDRESS 6
+#define BL_COM_UPLOADERR_TIMEOUT 7
 
 #define BL_COM_UPLOADOK_FINISHED 1
-#define BL_COM_UPLOADOK_HEADEROK 2
 #define BL_COM_UPLOADOK_LINEOK 3
+#define BL_COM_UPLOADOK_PAGEOK 4
+
+// hex upload: one record per line (':', hex digits in upper or lower case, no line break) -> one reply after its last digit:
+// LINEOK for data, FINISHED for EOF (ends the upload), OK for any other record type
+// after an error the upload ends, the rest of the line is discarded until the line is idle for BL_COM_UPLOAD_DISCARDTIMEOUT_MS
+#define BL_COM_UPLOAD_DISCARDTIMEOUT_MS 20
+
+// upload mode: one flags byte, valid for the next 'u' or 'b' upload, cleared when that upload ends (also on errors)
+// and by 's' (a new session), 'w' refuses to start while a mode is set
+// REPLACE: pages of record based uploads ('u', 'b') are filled with 0xFF instead of being read back,
+// for whole images sent in ascending order after an erase ('e', replies OK again when done)
+#define BL_COM_UPLOADMODE_REPLACE 1
+
+// binary upload frame: addr_h, addr_l, len, data[len], crc_h, crc_l (CRC-16/XMODEM over the whole frame)
+// a frame with len = 0 finishes the upload
+#define BL_COM_FRAME_HEADERLEN 3
+#define BL_COM_FRAME_MAXDATA 64
+
+// windowed upload: after the OK the bootloader sends the number of bytes the host may keep in flight
+// a window of 0 refuses the upload and is followed by the reason (INVALIDARG: an upload mode is set)
+// each frame is preceded by a sequence number: seq, addr_h, addr_l, len, data[len], crc_h, crc_l (crc includes seq)
+// every frame is answered with two bytes: status, seq
+// LINELEN and TIMEOUT errors mean the framing was lost: the bootloader discarded all input until the line was idle
+// a frame has to be complete BL_COM_WINDOW_FRAMETIMEOUT_MS after its sequence number (a full frame takes 37 ms at 19200 baud)
+#define BL_COM_WINDOW_FRAMETIMEOUT_MS 50
+#define BL_COM_WINDOW_IDLETIMEOUT_MS 2000
+
+// page write: addr_h, addr_l, data[BL_COM_PAGESIZE], crc_h, crc_l (CRC-16/XMODEM over the whole frame)
+#define BL_COM_PAGESIZE 128
+
+// compressed page write: addr_h, addr_l, len, stream[len], crc_h, crc_l (CRC-16/XMODEM over the whole frame)
+// stream tokens: 0x00 - 0x7F: token + 1 literal bytes follow
+//                0x80 - 0xFF: copy (token & 0x7F) + 2 bytes, starting (next byte) + 1 bytes back in the page
+#define BL_COM_LZ_MINMATCH 2
+#define BL_COM_LZ_MAXMATCH 129
+#define BL_COM_LZ_MAXLITERALS 128
+
+// verify crc: addr_h, addr_l, len_h, len_l -> CRC-32 (zlib) over the flash range (4 bytes, big endian)
+
+// dump: addr_h, addr_l, len_h, len_l -> len flash bytes
+
+// set baudrate: index into the BL_COM_BAUD_n list -> OK, then the bootloader switches to the new rate
+// the host confirms by sending BL_COM_CMD_SETBAUD at the new rate and gets an OK back
+// without confirmation the bootloader returns to the previous rate after BL_COM_BAUD_CONFIRMTIMEOUT_MS
+#define BL_COM_BAUD_CONFIRMTIMEOUT_MS 200
+#define BL_COM_BAUD_COUNT 7
+#define BL_COM_BAUD_0 19200
+#define BL_COM_BAUD_1 38400
+#define BL_COM_BAUD_2 57600
+#define BL_COM_BAUD_3 115200
+#define BL_COM_BAUD_4 250000
+#define BL_COM_BAUD_5 500000
+#define BL_COM_BAUD_6 1000000
+
+// flow control: mode byte -> OK or INVALIDARG (mode not available, e.g. RTS/CTS without pins)
+// the default is NONE, XONXOFF is only safe for ASCII transfers ('u') because the data bytes may be 0x11 / 0x13
+// CREDIT: the windowed upload ('w') starts with a credit limit instead of the window size and appends the
+// current limit to every reply (status, seq, limit). The host may send bytes as long as the low byte of the
+// number of bytes it sent after the 'w' command stays below the limit (8 bit arithmetic)
+#define BL_COM_FLOW_NONE 0
+#define BL_COM_FLOW_XONXOFF 1
+#define BL_COM_FLOW_RTSCTS 2
+#define BL_COM_FLOW_CREDIT 3
+
+// EEPROM write: a binary upload frame (addr_h, addr_l, len, data[len], crc_h, crc_l) -> LINEOK once the bytes are queued
+// the bootloader writes them in the background, only the bytes that differ, and not while a flash page is programmed
+// EEPROM crc / dump: addr_h, addr_l, len_h, len_l -> CRC-32 (4 bytes, big endian) / len bytes, after all queued writes
+// the bytes from BL_COM_EEPROM_APPSIZE on belong to the bootloader (application valid marker, image descriptor), 'E' rejects them
+#define BL_COM_EEPROM_SIZE 1024
+#define BL_COM_EEPROM_APPSIZE 1008
+
+// application valid: image descriptor (length: 2 bytes, CRC-32 as zlib.crc32: 4 bytes, version: 2 bytes, all big endian) -> OK
+// the bootloader calculates the CRC of the application section from 0 to length and replies OK once the descriptor
+// and the marker are stored, UPLOADERROR | CHECKSUM if the flash doesn't match (a marker set before is cleared,
+// UPLOADERROR | ADDRESS: length too large).
+// The host sends it after a successful verification, the bootloader clears the marker before it erases or
+// writes the first application page. With BLE_ALWAYS a power-on reset starts a marked application right away,
+// an unmarked one after the entry window. BL_BOOT_CHECK in main.c selects when the descriptor is checked at startup
+#define BL_COM_APPDESCRIPTOR_LEN 8
+
+// sync: nonce (BL_COM_SYNC_NONCELEN bytes) -> OK, nonce
+// the nonce bytes have the high bit set, so if the bootloader misses the 's' they are only unknown commands.
+// The host flushes its input and discards everything up to OK + nonce (stale replies, 'r', application output).
+// Without the complete nonce within BL_COM_SYNC_TIMEOUT_MS there is no echo.
+// A bootloader that still waits for the rest of a frame (host aborted mid-command) is freed by
+// BL_COM_SYNC_FILLLEN bytes of BL_COM_SYNC_FILL: the frame fails its length or CRC check, the rest are unknown commands
+#define BL_COM_SYNC_NONCELEN 4
+#define BL_COM_SYNC_TIMEOUT_MS 20
+#define BL_COM_SYNC_FILL 0b10000000
+#define BL_COM_SYNC_FILLLEN 260
+
+// page crcs: number of application pages (1 byte), then the CRC-16/XMODEM of every page (2 bytes each, big endian)
+
+// info: len, version string, len, boot section start (little endian), len, feature mask (little endian)
+// the mask lists the command groups compiled in (bootloader-config.h), 'q', 's' and 'i' are always available
+#define BL_COM_FEATURE_FUSES (1<<0)
+#define BL_COM_FEATURE_UPLOAD_HEX (1<<1)
+#define BL_COM_FEATURE_UPLOAD_BINARY (1<<2)
+#define BL_COM_FEATURE_UPLOAD_WINDOWED (1<<3)
+#define BL_COM_FEATURE_PAGE_WRITE (1<<4)
+#define BL_COM_FEATURE_PAGE_WRITE_COMPRESSED (1<<5)
+#define BL_COM_FEATURE_UPLOAD_MODE (1<<6)
+#define BL_COM_FEATURE_ERASE (1<<7)
+#define BL_COM_FEATURE_PAGE_CRCS (1<<8)
+#define BL_COM_FEATURE_VERIFY_CRC (1<<9)
+#define BL_COM_FEATURE_DUMP (1<<10)
+#define BL_COM_FEATURE_VERIFY (1<<11)
+#define BL_COM_FEATURE_SETBAUD (1<<12)
+#define BL_COM_FEATURE_FLOWCONTROL (1<<13)
+#define BL_COM_FEATURE_EEPROM (1<<14)
+#define BL_COM_FEATURE_APPVALID (1<<15)
 
 #endif /* BOOTLOADER_COMMUNICATION_H_ */
\ No newline at end of file
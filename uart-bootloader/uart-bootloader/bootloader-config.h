@@ -0,0 +1,125 @@
+/*
+ * bootloader-config.h
+ *
+ * Compile-time feature selection. Every BL_FEATURE_* switch can be set with -D, the profiles change the defaults:
+ *	- full (default): all commands, LED diagnostics and the demo application
+ *	- BL_PROFILE_MINIMAL: sync, info, page write ('p'), CRC verification ('h') and quit
+ *	- BL_PROFILE_TINY: sync, info, page write and quit, polled USART without buffers and interrupts,
+ *	  built without the C runtime and the vector table (BL_NO_STARTFILES)
+ * The Makefile selects them with PROFILE=minimal / tiny, `make size-report` lists which BOOTSZ class each profile fits.
+ * Commands that are not compiled in are answered as unknown, the info reply ('i') carries the feature mask.
+ */
+
+
+#ifndef BOOTLOADER_CONFIG_H_
+#define BOOTLOADER_CONFIG_H_
+
+#if defined(BL_PROFILE_MINIMAL) || defined(BL_PROFILE_TINY)
+#define BL_FEATURE_DEFAULT 0
+#else
+#define BL_FEATURE_DEFAULT 1
+#endif
+
+// commands, see bootloader-communication.h
+#ifndef BL_FEATURE_FUSES
+#define BL_FEATURE_FUSES BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_UPLOAD_HEX
+#define BL_FEATURE_UPLOAD_HEX BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_UPLOAD_BINARY
+#define BL_FEATURE_UPLOAD_BINARY BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_UPLOAD_WINDOWED
+#define BL_FEATURE_UPLOAD_WINDOWED BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_PAGE_WRITE
+#define BL_FEATURE_PAGE_WRITE 1
+#endif
+#ifndef BL_FEATURE_PAGE_WRITE_COMPRESSED
+#define BL_FEATURE_PAGE_WRITE_COMPRESSED BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_UPLOAD_MODE
+#define BL_FEATURE_UPLOAD_MODE BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_ERASE
+#define BL_FEATURE_ERASE BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_PAGE_CRCS
+#define BL_FEATURE_PAGE_CRCS BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_VERIFY_CRC
+#ifdef BL_PROFILE_TINY
+#define BL_FEATURE_VERIFY_CRC 0
+#else
+#define BL_FEATURE_VERIFY_CRC 1
+#endif
+#endif
+#ifndef BL_FEATURE_DUMP
+#define BL_FEATURE_DUMP BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_VERIFY
+#define BL_FEATURE_VERIFY BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_SETBAUD
+#define BL_FEATURE_SETBAUD BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_FLOWCONTROL
+#define BL_FEATURE_FLOWCONTROL BL_FEATURE_DEFAULT
+#endif
+// EEPROM write / crc / dump and the background write queue
+#ifndef BL_FEATURE_EEPROM
+#define BL_FEATURE_EEPROM BL_FEATURE_DEFAULT
+#endif
+// 'a', the application valid marker and the startup check (BL_BOOT_CHECK)
+#ifndef BL_FEATURE_APPVALID
+#define BL_FEATURE_APPVALID BL_FEATURE_DEFAULT
+#endif
+
+// RX / TX ring buffers and their interrupts (MyUSART.h), without them the USART is polled (USART_POLLED).
+// Bytes that arrive while a reply is sent or a page is loaded for SPM can be lost, the windowed upload and
+// flow control need the buffers
+#ifndef BL_FEATURE_USART_BUFFERED
+#ifdef BL_PROFILE_TINY
+#define BL_FEATURE_USART_BUFFERED 0
+#else
+#define BL_FEATURE_USART_BUFFERED 1
+#endif
+#endif
+#if !BL_FEATURE_USART_BUFFERED && (BL_FEATURE_UPLOAD_WINDOWED || BL_FEATURE_FLOWCONTROL)
+#error "BL_FEATURE_UPLOAD_WINDOWED and BL_FEATURE_FLOWCONTROL need BL_FEATURE_USART_BUFFERED"
+#endif
+
+// BL_NO_STARTFILES (set by the Makefile for PROFILE=tiny, linked with -nostartfiles): no C runtime and no interrupt
+// vector table, main.c brings its own entry and interrupts stay off
+#if defined(BL_NO_STARTFILES) && BL_FEATURE_USART_BUFFERED
+#error "BL_NO_STARTFILES has no vector table for the USART interrupts of BL_FEATURE_USART_BUFFERED"
+#endif
+
+// board extras in main.c: RGB status LEDs and the demo application at 0x0000
+#ifndef BL_FEATURE_LEDS
+#define BL_FEATURE_LEDS BL_FEATURE_DEFAULT
+#endif
+#ifndef BL_FEATURE_DEMOAPP
+#define BL_FEATURE_DEMOAPP BL_FEATURE_DEFAULT
+#endif
+
+#define BL_FEATURES ( \
+	(BL_FEATURE_FUSES ? BL_COM_FEATURE_FUSES : 0) | \
+	(BL_FEATURE_UPLOAD_HEX ? BL_COM_FEATURE_UPLOAD_HEX : 0) | \
+	(BL_FEATURE_UPLOAD_BINARY ? BL_COM_FEATURE_UPLOAD_BINARY : 0) | \
+	(BL_FEATURE_UPLOAD_WINDOWED ? BL_COM_FEATURE_UPLOAD_WINDOWED : 0) | \
+	(BL_FEATURE_PAGE_WRITE ? BL_COM_FEATURE_PAGE_WRITE : 0) | \
+	(BL_FEATURE_PAGE_WRITE_COMPRESSED ? BL_COM_FEATURE_PAGE_WRITE_COMPRESSED : 0) | \
+	(BL_FEATURE_UPLOAD_MODE ? BL_COM_FEATURE_UPLOAD_MODE : 0) | \
+	(BL_FEATURE_ERASE ? BL_COM_FEATURE_ERASE : 0) | \
+	(BL_FEATURE_PAGE_CRCS ? BL_COM_FEATURE_PAGE_CRCS : 0) | \
+	(BL_FEATURE_VERIFY_CRC ? BL_COM_FEATURE_VERIFY_CRC : 0) | \
+	(BL_FEATURE_DUMP ? BL_COM_FEATURE_DUMP : 0) | \
+	(BL_FEATURE_VERIFY ? BL_COM_FEATURE_VERIFY : 0) | \
+	(BL_FEATURE_SETBAUD ? BL_COM_FEATURE_SETBAUD : 0) | \
+	(BL_FEATURE_FLOWCONTROL ? BL_COM_FEATURE_FLOWCONTROL : 0) | \
+	(BL_FEATURE_EEPROM ? BL_COM_FEATURE_EEPROM : 0) | \
+	(BL_FEATURE_APPVALID ? BL_COM_FEATURE_APPVALID : 0))
+
+#endif /* BOOTLOADER_CONFIG_H_ */
@@ -0,0 +1,1297 @@
+/*
+ * bootloader-core.h
+ *
+ * Protocol and flash programming logic of the bootloader, without any register access.
+ *
+ * The including file provides the platform before including this header:
+ *	- F_CPU, BL_INFO_VERSION, BL_INFO_BLSECTIONSTART
+ *	- the MyUSART.h API (USART_Receive, USART_ReceiveSpan / USART_ReceiveCommit, USART_Transmit, ...), with USART_RX_IDLE() calling flash_poll()
+ *	- the avr-libc SPM (boot_page_fill, boot_spm_busy, ...), EEPROM (eeprom_is_ready, eeprom_update_byte, ...), pgm_read_* and crc16 functions, SREG and cli()
+ *	- set_rgb_leds(uint8_t flag), may be an empty macro
+ *
+ * bootloader-config.h selects the commands that are compiled in (BL_FEATURE_*), commands are looked up in bl_commands.
+ *
+ * main.c includes it for the device, host/host-main.c for the Linux build with a fake flash.
+ */ 
+
+
+#ifndef BOOTLOADER_CORE_H_
+#define BOOTLOADER_CORE_H_
+
+#include "bootloader-communication.h"
+#include "bootloader-config.h"
+
+// Red, Green, Blue Test LEDs
+#define LED_RED	1
+#define LED_GREEN 2
+#define LED_BLUE 4
+
+// page assembly of the record based uploads ('u', 'b', 'w')
+#define BL_RECORD_UPLOAD (BL_FEATURE_UPLOAD_HEX || BL_FEATURE_UPLOAD_BINARY || BL_FEATURE_UPLOAD_WINDOWED)
+// CRC-32 of flash ranges ('h', 'a') and EEPROM ranges ('H')
+#define BL_CRC32 (BL_FEATURE_VERIFY_CRC || BL_FEATURE_APPVALID || BL_FEATURE_EEPROM)
+
+// hex file decoding
+#define HEX_RTYPE_DATARECORD 0
+#define HEX_RTYPE_EOF 1
+#define HEX_RTYPE_STARTSEGMENTADDRESSRECORD 3
+#define HEX_RECORD_HEADERLEN 4 // bytecount, address_h, address_l, rtype
+
+// bootloader bytes at the end of the EEPROM: marker, check pending flag, image descriptor (little endian)
+#define BL_EEPROM_APPVALID BL_COM_EEPROM_APPSIZE
+#define BL_EEPROM_CHECKPENDING (BL_COM_EEPROM_APPSIZE + 1)
+#define BL_EEPROM_APPLENGTH (BL_COM_EEPROM_APPSIZE + 2)
+#define BL_EEPROM_APPCRC (BL_COM_EEPROM_APPSIZE + 4)
+#define BL_EEPROM_APPVERSION (BL_COM_EEPROM_APPSIZE + 8)
+#define BL_APPVALID_MAGIC 0xA5
+// the application section doesn't hold a complete image: changed by a session that didn't end with 'a' or 'q',
+// or the marked image failed its boot check (erased EEPROM, 0xFF, means never marked)
+#define BL_APPVALID_INCOMPLETE 0x5A
+
+// startup check of a marked application against its descriptor: never, on the first start after 'a' or on every start
+#define BL_BOOT_CHECK_NONE 0
+#define BL_BOOT_CHECK_FIRST 1
+#define BL_BOOT_CHECK_ALWAYS 2
+#ifndef BL_BOOT_CHECK
+#define BL_BOOT_CHECK BL_BOOT_CHECK_FIRST
+#endif // BL_BOOT_CHECK
+
+// CRC-32 with a 256 entry table: 1 KB more flash, about a third of the cycles per byte of the 16 entry table,
+// selected by BL_BOOT_CHECK_ALWAYS because that check runs before every start of the application
+#ifndef BL_CRC32_TABLE256
+#define BL_CRC32_TABLE256 (BL_BOOT_CHECK == BL_BOOT_CHECK_ALWAYS)
+#endif // BL_CRC32_TABLE256
+
+#if SPM_PAGESIZE != BL_COM_PAGESIZE
+#error "BL_COM_PAGESIZE does not match the flash page size of the device"
+#endif
+
+// reads from the application section, the host build maps them onto its fake flash
+#ifndef flash_read_byte
+#define flash_read_byte(addr) pgm_read_byte(addr)
+#define flash_read_word(addr) pgm_read_word(addr)
+#define flash_read_dword(addr) pgm_read_dword(addr)
+#endif // flash_read_byte
+
+#if BL_RECORD_UPLOAD
+volatile uint16_t page_start_address = 0;
+volatile uint16_t next_page_start_address = SPM_PAGESIZE;
+volatile uint8_t page_used = 0;
+uint8_t page_written_mask[SPM_PAGESIZE / 8];
+#endif // BL_RECORD_UPLOAD
+
+#if BL_FEATURE_UPLOAD_MODE
+// only applies to the next record based upload, see upload_mode_reset()
+uint8_t upload_mode = 0;
+#define upload_mode_reset() (upload_mode = 0)
+#else
+#define upload_mode 0
+#define upload_mode_reset()
+#endif // BL_FEATURE_UPLOAD_MODE
+
+// background page programming
+#define FLASH_IDLE 0
+#define FLASH_ERASING 1
+#define FLASH_WRITING 2
+#define FLASH_ERASEONLY 3
+
+volatile uint8_t flash_state = FLASH_IDLE;
+uint16_t flash_address = 0;
+
+#if BL_FEATURE_EEPROM
+// background EEPROM writes, one byte per EEPROM write cycle (3.3 ms)
+#define EEPROM_QUEUE_SIZE 64 // power of two
+struct eeprom_write {
+	uint16_t address;
+	uint8_t data;
+};
+struct eeprom_write eeprom_queue[EEPROM_QUEUE_SIZE];
+uint8_t eeprom_queue_start = 0, eeprom_queue_end = 0;
+#endif // BL_FEATURE_EEPROM
+
+#if BL_FEATURE_APPVALID
+// copy of the application valid marker, set to BL_APPVALID_INCOMPLETE before the application section changes
+uint8_t app_marker;
+#endif // BL_FEATURE_APPVALID
+
+#if BL_CRC32 && BL_CRC32_TABLE256
+// CRC-32 (reflected 0xEDB88320) lookup table for one byte
+const uint32_t crc32_table[256] PROGMEM = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+	0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+	0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+	0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+	0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+	0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+	0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+	0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+	0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+	0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+	0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+	0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+	0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+	0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+	0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+	0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+	0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+	0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+	0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+	0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+	0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+#elif BL_CRC32
+// CRC-32 (reflected 0xEDB88320) lookup table for one nibble
+const uint32_t crc32_table[16] PROGMEM = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+#endif // BL_CRC32 && BL_CRC32_TABLE256
+
+#if BL_FEATURE_SETBAUD
+// UBRR values for the BL_COM_BAUD_n rates, bit 15 selects double speed (U2X)
+#define BAUD_TABLE_U2X 0x8000
+const uint16_t baud_table[BL_COM_BAUD_COUNT] PROGMEM = {
+	USART_UBRR(BL_COM_BAUD_0),
+	USART_UBRR(BL_COM_BAUD_1),
+	USART_UBRR_U2X(BL_COM_BAUD_2) | BAUD_TABLE_U2X, // -0.8% instead of 2.1% error at 16 MHz
+	USART_UBRR_U2X(BL_COM_BAUD_3) | BAUD_TABLE_U2X, // 2.1% instead of -3.5% error at 16 MHz
+	USART_UBRR(BL_COM_BAUD_4),
+	USART_UBRR(BL_COM_BAUD_5),
+	USART_UBRR(BL_COM_BAUD_6)
+};
+// rate in use (baud_table format), an unconfirmed switch returns to it
+uint16_t baud_current = BAUD_CONST;
+#endif // BL_FEATURE_SETBAUD
+
+const uint16_t bl_sectionstartaddress = BL_INFO_BLSECTIONSTART;
+const uint16_t bl_features = BL_FEATURES;
+
+
+// advance the page programming state machine once the previous SPM operation is done
+void flash_poll() {
+	// SPM must not start while an EEPROM write is running
+	if(flash_state == FLASH_IDLE || boot_spm_busy() || !eeprom_is_ready())
+		return;
+	
+	uint8_t sreg = SREG;
+	cli();
+	if(flash_state == FLASH_ERASING) {
+		boot_page_write(flash_address);
+		flash_state = FLASH_WRITING;
+	} else {
+		boot_rww_enable();
+		flash_state = FLASH_IDLE;
+	}
+	SREG = sreg;
+}
+
+// wait until the last page is programmed and the application section is readable again
+void flash_sync() {
+	while(flash_state != FLASH_IDLE)
+		flash_poll();
+}
+
+#if BL_FEATURE_APPVALID
+uint8_t app_valid() {
+	return eeprom_read_byte((const uint8_t*)(uintptr_t) BL_EEPROM_APPVALID) == BL_APPVALID_MAGIC;
+}
+
+uint8_t app_incomplete() {
+	return eeprom_read_byte((const uint8_t*)(uintptr_t) BL_EEPROM_APPVALID) == BL_APPVALID_INCOMPLETE;
+}
+
+// only called with the flash idle, SPM and EEPROM writes must not overlap
+static void app_invalidate() {
+	if(app_marker == BL_APPVALID_INCOMPLETE)
+		return;
+	eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_APPVALID, BL_APPVALID_INCOMPLETE);
+	app_marker = BL_APPVALID_INCOMPLETE;
+}
+#else
+// no marker: nothing to clear, main.c opens the entry window on every reset
+#define app_valid() 0
+#define app_incomplete() 0
+#define app_boot_check() 1
+#define app_broken() 0
+#define app_invalidate()
+#define app_session_end()
+#endif // BL_FEATURE_APPVALID
+
+/*
+	The page is loaded into the SPM temporary page buffer before the erase (datasheet alternative 1),
+	so ram_page_buffer can be reused right away. Erase and write run in the background (see flash_poll())
+	while the RX interrupt keeps receiving the next page; only the SPM instructions run with interrupts disabled.
+*/
+static void write_flash_page(uint16_t address, uint8_t* ram_page_buffer) {
+	uint8_t sreg;
+	
+	flash_sync();
+	app_invalidate();
+	eeprom_busy_wait();
+	
+	for(uint16_t counter = 0; counter < SPM_PAGESIZE; counter += 2) {
+		boot_spm_busy_wait();
+		sreg = SREG;
+		cli();
+		boot_page_fill(counter, ram_page_buffer[counter + 1] << 8 | ram_page_buffer[counter]);
+		SREG = sreg;
+	}
+	
+	boot_spm_busy_wait();
+	sreg = SREG;
+	cli();
+	boot_page_erase(address);
+	flash_address = address;
+	flash_state = FLASH_ERASING;
+	SREG = sreg;
+}
+
+#if BL_FEATURE_ERASE
+static void erase_flash_page(uint16_t address) {
+	flash_sync();
+	app_invalidate();
+	eeprom_busy_wait();
+	
+	boot_spm_busy_wait();
+	uint8_t sreg = SREG;
+	cli();
+	boot_page_erase(address);
+	flash_address = address;
+	flash_state = FLASH_ERASEONLY;
+	SREG = sreg;
+}
+#endif // BL_FEATURE_ERASE
+
+#if BL_FEATURE_EEPROM
+// start the next queued EEPROM write, only while no page is programmed
+void eeprom_poll() {
+	while(eeprom_queue_start != eeprom_queue_end && flash_state == FLASH_IDLE && eeprom_is_ready()) {
+		// bytes that already hold the value are skipped without a write cycle
+		struct eeprom_write* entry = &eeprom_queue[eeprom_queue_start];
+		eeprom_update_byte((uint8_t*)(uintptr_t) entry->address, entry->data);
+		eeprom_queue_start = (eeprom_queue_start + 1) & (EEPROM_QUEUE_SIZE - 1);
+	}
+}
+#endif // BL_FEATURE_EEPROM
+
+// background work while waiting for UART data (USART_RX_IDLE)
+void bl_idle() {
+	flash_poll();
+#if BL_FEATURE_EEPROM
+	eeprom_poll();
+#endif // BL_FEATURE_EEPROM
+}
+
+#if BL_FEATURE_EEPROM
+static void eeprom_queue_write(uint16_t address, uint8_t data) {
+	uint8_t next = (eeprom_queue_end + 1) & (EEPROM_QUEUE_SIZE - 1);
+	while(next == eeprom_queue_start)
+		bl_idle();
+	eeprom_queue[eeprom_queue_end].address = address;
+	eeprom_queue[eeprom_queue_end].data = data;
+	eeprom_queue_end = next;
+}
+
+// wait until every queued byte is written
+void eeprom_sync() {
+	while(eeprom_queue_start != eeprom_queue_end)
+		bl_idle();
+	eeprom_busy_wait();
+}
+#else
+// only the direct writes of the bootloader bytes
+#define eeprom_sync() eeprom_busy_wait()
+#endif // BL_FEATURE_EEPROM
+
+#if BL_RECORD_UPLOAD
+static inline void handle_page_write(uint8_t* ram_page_buffer) {
+	if(page_used) {
+		// bytes not covered by the uploaded data keep their current flash content,
+		// when replacing the whole image they stay erased and the page doesn't have to be read
+		uint8_t replace = upload_mode & BL_COM_UPLOADMODE_REPLACE;
+		if(!replace)
+			flash_sync();
+		for(uint8_t counter = 0; counter < SPM_PAGESIZE; counter++) {
+			if(!(page_written_mask[counter >> 3] & (1 << (counter & 7))))
+				ram_page_buffer[counter] = replace ? 0xFF : flash_read_byte(page_start_address + counter);
+		}
+		
+		write_flash_page(page_start_address, ram_page_buffer);
+		
+		// buffer content is now in flash, the next record has to reload the page
+		page_used = 0;
+	}
+}
+
+// makes the page of address the current one and returns the offset of address in it, a used page is written first
+static inline uint8_t page_select(uint16_t address, uint8_t* ram_page_buffer) {
+	if(address < page_start_address || address >= next_page_start_address) {
+		handle_page_write(ram_page_buffer);
+		page_start_address = address & ~(SPM_PAGESIZE - 1);
+		next_page_start_address = page_start_address + SPM_PAGESIZE;
+	}
+	if(!page_used) {
+		// the current flash content is merged in when the page is written
+		for(uint8_t i = 0; i < sizeof(page_written_mask); i++)
+			page_written_mask[i] = 0;
+		page_used = 1;
+	}
+	return address - page_start_address;
+}
+
+/*
+	Copies the data of a record into the page buffer one page at a time, so records may start anywhere and cross
+	any number of page boundaries. Interrupts stay enabled, only the SPM instructions in write_flash_page() run with
+	them disabled.
+*/
+void handle_hex_data(uint16_t addr, uint8_t bytecount, uint8_t* data_buf, uint8_t* ram_page_buffer) {
+	while(bytecount > 0) {
+		uint8_t offset = page_select(addr, ram_page_buffer);
+		uint8_t count = SPM_PAGESIZE - offset;
+		if(count > bytecount)
+			count = bytecount;
+		
+		for(uint8_t i = 0; i < count; i++, offset++) {
+			ram_page_buffer[offset] = data_buf[i];
+			page_written_mask[offset >> 3] |= 1 << (offset & 7);
+		}
+		
+		addr += count;
+		data_buf += count;
+		bytecount -= count;
+	}
+}
+#endif // BL_RECORD_UPLOAD
+
+#if BL_CRC32
+static inline uint32_t crc32_update(uint32_t crc, uint8_t data) {
+#if BL_CRC32_TABLE256
+	// the shift by 8 is a byte move, no shift loop
+	crc = (crc >> 8) ^ pgm_read_dword(&crc32_table[(uint8_t) crc ^ data]);
+#else
+	crc = (crc >> 4) ^ pgm_read_dword(&crc32_table[(crc ^ data) & 0x0F]);
+	crc = (crc >> 4) ^ pgm_read_dword(&crc32_table[(crc ^ (data >> 4)) & 0x0F]);
+#endif // BL_CRC32_TABLE256
+	return crc;
+}
+
+// CRC-32 of a flash range, same result as zlib.crc32()
+uint32_t crc32_flash(uint16_t addr, uint16_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	
+	// read dword-wise, the flash is little endian
+	for(; len >= 4; len -= 4, addr += 4) {
+		uint32_t dword = flash_read_dword(addr);
+		for(uint8_t i = 0; i < 4; i++) {
+			crc = crc32_update(crc, (uint8_t) dword);
+			dword >>= 8;
+		}
+	}
+	for(; len > 0; len--, addr++)
+		crc = crc32_update(crc, flash_read_byte(addr));
+	
+	return ~crc;
+}
+
+#if BL_FEATURE_EEPROM
+uint32_t crc32_eeprom(uint16_t addr, uint16_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	for(; len > 0; len--, addr++)
+		crc = crc32_update(crc, eeprom_read_byte((const uint8_t*)(uintptr_t) addr));
+	return ~crc;
+}
+#endif // BL_FEATURE_EEPROM
+#endif // BL_CRC32
+
+#if BL_FEATURE_APPVALID
+static uint32_t eeprom_read_le(uint16_t addr, uint8_t len) {
+	uint32_t value = 0;
+	while(len > 0) {
+		len--;
+		value = (value << 8) | eeprom_read_byte((const uint8_t*)(uintptr_t) (addr + len));
+	}
+	return value;
+}
+
+// direct write, only with the flash idle
+static void eeprom_write_le(uint16_t addr, uint32_t value, uint8_t len) {
+	for(uint8_t i = 0; i < len; i++, value >>= 8)
+		eeprom_update_byte((uint8_t*)(uintptr_t) (addr + i), value);
+}
+
+// called at startup for a marked application (see BL_BOOT_CHECK), clears the marker if the flash doesn't match the descriptor
+uint8_t app_boot_check() {
+#if BL_BOOT_CHECK == BL_BOOT_CHECK_NONE
+	return 1;
+#else
+#if BL_BOOT_CHECK == BL_BOOT_CHECK_FIRST
+	if(eeprom_read_byte((const uint8_t*)(uintptr_t) BL_EEPROM_CHECKPENDING) != BL_APPVALID_MAGIC)
+		return 1;
+#endif // BL_BOOT_CHECK == BL_BOOT_CHECK_FIRST
+	if(crc32_flash(0, eeprom_read_le(BL_EEPROM_APPLENGTH, 2)) != eeprom_read_le(BL_EEPROM_APPCRC, 4)) {
+		eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_APPVALID, BL_APPVALID_INCOMPLETE);
+		return 0;
+	}
+	eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_CHECKPENDING, 0xFF);
+	return 1;
+#endif // BL_BOOT_CHECK == BL_BOOT_CHECK_NONE
+}
+
+// called at startup: 1 if the flash must not be started (unfinished upload or a marked application that fails its check)
+uint8_t app_broken() {
+	return app_incomplete() || (app_valid() && !app_boot_check());
+}
+
+// 'q': the tool ended the session, an image it didn't mark is treated like one flashed without the marker
+static void app_session_end() {
+	if(app_marker != BL_APPVALID_INCOMPLETE)
+		return;
+	flash_sync();
+	eeprom_sync();
+	eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_APPVALID, 0xFF);
+	app_marker = 0xFF;
+}
+#endif // BL_FEATURE_APPVALID
+
+#if BL_FEATURE_UPLOAD_HEX
+// '0' - '9', 'A' - 'F', 'a' - 'f', 0xFF for anything else
+static inline uint8_t hex_digit(uint8_t c) {
+	if((uint8_t) (c - '0') < 10)
+		return c - '0';
+	c |= 0x20;
+	if((uint8_t) (c - 'a') < 6)
+		return c - 'a' + 0xA;
+	return 0xFF;
+}
+
+// the rest of the line is dropped, otherwise its hex digits would be taken as commands
+static uint8_t hex_record_error(uint8_t error) {
+	USART_DiscardRX(BL_COM_UPLOAD_DISCARDTIMEOUT_MS);
+	return BL_COM_REPLY_UPLOADERROR | error;
+}
+
+/*
+	Decodes one hex record while its characters arrive, every digit is taken from the RX buffer as soon as it is there.
+	Byte values are summed up for the checksum and data bytes are collected in data_buf (0xFF bytes), so the record
+	is checked the moment its last digit is received. Only a record with a correct checksum reaches the page buffer,
+	a bad one never causes a page to be written. Returns the reply to the record.
+*/
+uint8_t receive_hex_record(uint8_t* data_buf, uint8_t* ram_page_buffer) {
+	if(USART_Receive() != ':')
+		return hex_record_error(BL_COM_UPLOADERR_COLON);
+	
+	uint8_t checksum = 0;
+	uint8_t bytecount = 0;
+	uint8_t rtype = 0;
+	uint16_t address = 0;
+	uint8_t value = 0;
+	uint8_t high = 1;
+	// byte of the record: bytecount, address_h, address_l, rtype, data[bytecount], checksum
+	uint16_t index = 0;
+	uint16_t length = HEX_RECORD_HEADERLEN + 1;
+	
+	while(index < length) {
+		uint8_t* span;
+		uint16_t digits = (length - index) * 2 - !high;
+		uint8_t len = USART_ReceiveSpan(&span, digits > 0xFF ? 0xFF : digits);
+		for(uint8_t i = 0; i < len; i++) {
+			uint8_t nibble = hex_digit(span[i]);
+			if(nibble > 0xF) {
+				USART_ReceiveCommit(i + 1);
+				return hex_record_error(index == 1 || index == 2 ? BL_COM_UPLOADERR_HEXVAL_16 : BL_COM_UPLOADERR_HEXVAL_8);
+			}
+			value = (value << 4) | nibble;
+			high = !high;
+			if(!high)
+				continue;
+			
+			checksum += value;
+			if(index >= HEX_RECORD_HEADERLEN) {
+				if(index < length - 1)
+					data_buf[index - HEX_RECORD_HEADERLEN] = value;
+			} else if(index == 0) {
+				bytecount = value;
+				length += bytecount;
+			} else if(index < 3) {
+				address = (address << 8) | value;
+			} else {
+				rtype = value;
+				if(rtype == HEX_RTYPE_DATARECORD && address > BL_INFO_BLSECTIONSTART - bytecount) {
+					USART_ReceiveCommit(i + 1);
+					return hex_record_error(BL_COM_UPLOADERR_ADDRESS);
+				}
+			}
+			index++;
+		}
+		USART_ReceiveCommit(len);
+	}
+	set_rgb_leds(5);
+	
+	if(checksum != 0)
+		return BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM;
+	
+	if(rtype == HEX_RTYPE_EOF) {
+		handle_page_write(ram_page_buffer);
+		return BL_COM_REPLY_OK | BL_COM_UPLOADOK_FINISHED;
+	}
+	if(rtype == HEX_RTYPE_DATARECORD) {
+		handle_hex_data(address, bytecount, data_buf, ram_page_buffer);
+		set_rgb_leds(4);
+		return BL_COM_REPLY_OK | BL_COM_UPLOADOK_LINEOK;
+	}
+	// start segment and extended address records don't matter below 64 KB
+	return BL_COM_REPLY_OK;
+}
+#endif // BL_FEATURE_UPLOAD_HEX
+
+#if BL_FEATURE_UPLOAD_BINARY || BL_FEATURE_PAGE_WRITE || BL_FEATURE_EEPROM
+// copies len received bytes to buffer and continues the frame crc over them in the same pass
+static uint16_t receive_crc(uint8_t* buffer, uint8_t len, uint16_t crc) {
+	while(len > 0) {
+		uint8_t* span;
+		uint8_t n = USART_ReceiveSpan(&span, len);
+		for(uint8_t i = 0; i < n; i++) {
+			buffer[i] = span[i];
+			crc = _crc_xmodem_update(crc, span[i]);
+		}
+		USART_ReceiveCommit(n);
+		buffer += n;
+		len -= n;
+	}
+	return crc;
+}
+#endif // BL_FEATURE_UPLOAD_BINARY || BL_FEATURE_PAGE_WRITE || BL_FEATURE_EEPROM
+
+#if BL_FEATURE_UPLOAD_HEX
+static inline void _handle_cmd_upload() {
+	uint8_t ram_page_buffer[SPM_PAGESIZE];
+	uint8_t data_buf[0xFF];
+	
+	set_rgb_leds(0);
+	
+	// the page of an aborted upload is not continued, its buffer is gone
+	page_used = 0;
+	
+	// one reply per record, the EOF record or the first error ends the upload
+	uint8_t reply;
+	do {
+		set_rgb_leds(7);
+		reply = receive_hex_record(data_buf, ram_page_buffer);
+		USART_Transmit(reply);
+	} while((reply & BL_COM_REPLY_STATUSMASK) == BL_COM_REPLY_OK && reply != (BL_COM_REPLY_OK | BL_COM_UPLOADOK_FINISHED));
+	
+	// finished or aborted, the next upload starts with the default mode again
+	upload_mode_reset();
+}
+#endif // BL_FEATURE_UPLOAD_HEX
+
+#if BL_FEATURE_UPLOAD_BINARY
+static inline void _handle_cmd_upload_binary() {
+	uint8_t ram_page_buffer[SPM_PAGESIZE];
+	uint8_t frame[BL_COM_FRAME_HEADERLEN + BL_COM_FRAME_MAXDATA + 2];
+	
+	set_rgb_leds(0);
+	
+	// the page of an aborted upload is not continued, its buffer is gone
+	page_used = 0;
+	
+	while(1) {
+		set_rgb_leds(7);
+		uint16_t crc = receive_crc(frame, BL_COM_FRAME_HEADERLEN, 0);
+		
+		uint8_t bytecount = frame[2];
+		if(bytecount > BL_COM_FRAME_MAXDATA) {
+			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_LINELEN);
+			break;
+		}
+		
+		// payload + crc, the crc is appended big endian, so running it over the complete frame yields 0
+		crc = receive_crc(frame + BL_COM_FRAME_HEADERLEN, bytecount + 2, crc);
+		set_rgb_leds(6);
+		
+		if(crc != 0) {
+			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
+			break;
+		}
+		
+		if(bytecount == 0) {
+			handle_page_write(ram_page_buffer);
+			USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_FINISHED);
+			break;
+		}
+		
+		uint16_t address_val = (frame[0] << 8) | frame[1];
+		if(address_val + bytecount > BL_INFO_BLSECTIONSTART) {
+			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_ADDRESS);
+			break;
+		}
+		
+		set_rgb_leds(4);
+		handle_hex_data(address_val, bytecount, frame + BL_COM_FRAME_HEADERLEN, ram_page_buffer);
+		
+		USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_LINEOK);
+	}
+	
+	// finished or aborted, the next upload starts with the default mode again
+	upload_mode_reset();
+}
+#endif // BL_FEATURE_UPLOAD_BINARY
+
+// the flow control modes of the protocol are passed to the USART as they are
+#if BL_COM_FLOW_NONE != USART_FLOW_NONE || BL_COM_FLOW_XONXOFF != USART_FLOW_XONXOFF || BL_COM_FLOW_RTSCTS != USART_FLOW_RTSCTS || BL_COM_FLOW_CREDIT != USART_FLOW_CREDIT
+#error "BL_COM_FLOW_* and USART_FLOW_* differ"
+#endif
+
+#if BL_FEATURE_UPLOAD_WINDOWED
+// reply to a windowed frame, with credit based flow control followed by the current credit limit
+static void window_reply(uint8_t status, uint8_t seq, uint8_t consumed_start) {
+	USART_Transmit(status);
+	USART_Transmit(seq);
+	if(usartFlowControl == USART_FLOW_CREDIT)
+		USART_Transmit((uint8_t) (USART_RXConsumed() - consumed_start + RX_BUFFERSIZE));
+}
+
+// copies len bytes of a frame out of the receive buffer and runs the crc over them,
+// returns 1 once the ticks left for the frame are used up
+static uint8_t receive_frame_crc(uint8_t* buffer, uint8_t len, uint16_t* crc, uint16_t* ticks) {
+	while(len > 0) {
+		if(USART_AwaitRXTicks(ticks))
+			return 1;
+		uint8_t* span;
+		uint8_t n = USART_ReceiveSpan(&span, len);
+		for(uint8_t i = 0; i < n; i++) {
+			buffer[i] = span[i];
+			*crc = _crc_xmodem_update(*crc, span[i]);
+		}
+		USART_ReceiveCommit(n);
+		buffer += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static inline void _handle_cmd_upload_windowed() {
+	uint8_t ram_page_buffer[SPM_PAGESIZE];
+	uint8_t frame[1 + BL_COM_FRAME_HEADERLEN + BL_COM_FRAME_MAXDATA + 2];
+	uint8_t* const header = frame + 1;
+	// the host counts its bytes from here on
+	uint8_t consumed_start = USART_RXConsumed();
+	
+	set_rgb_leds(0);
+	
+	// retransmitted frames reopen pages that were already written, replace mode would erase the rest of them
+	if(upload_mode) {
+		USART_Transmit(0);
+		USART_Transmit(BL_COM_REPLY_INVALIDARG);
+		return;
+	}
+	
+	// the page of an aborted upload is not continued, its buffer is gone
+	page_used = 0;
+	
+	// credit: the whole buffer is free, otherwise the bytes the host may send ahead without triggering XOFF / RTS
+	if(usartFlowControl == USART_FLOW_CREDIT)
+		USART_Transmit(RX_BUFFERSIZE);
+	else
+		USART_Transmit(RX_BUFFERSIZE - RX_FREE_XOFF - 1);
+	
+	while(1) {
+		set_rgb_leds(7);
+		
+		// host went away: keep what was acknowledged and return to the command loop
+		if(USART_ReceiveTimeout((char*)frame, BL_COM_WINDOW_IDLETIMEOUT_MS)) {
+			handle_page_write(ram_page_buffer);
+			break;
+		}
+		
+		// one deadline for the rest of the frame, counted from its sequence number
+		uint16_t ticks = BL_COM_WINDOW_FRAMETIMEOUT_MS * USART_TICKS_PER_MS;
+		uint16_t crc = _crc_xmodem_update(0, frame[0]);
+		uint8_t error = 0;
+		if(receive_frame_crc(header, BL_COM_FRAME_HEADERLEN, &crc, &ticks)) {
+			error = BL_COM_UPLOADERR_TIMEOUT;
+		} else if(header[2] > BL_COM_FRAME_MAXDATA) {
+			error = BL_COM_UPLOADERR_LINELEN;
+		} else if(receive_frame_crc(header + BL_COM_FRAME_HEADERLEN, header[2] + 2, &crc, &ticks)) {
+			error = BL_COM_UPLOADERR_TIMEOUT;
+		}
+		
+		if(error) {
+			// framing is lost, the host resends everything it has in flight
+			USART_DiscardRX(BL_COM_WINDOW_FRAMETIMEOUT_MS);
+			window_reply(BL_COM_REPLY_UPLOADERROR | error, frame[0], consumed_start);
+			continue;
+		}
+		set_rgb_leds(6);
+		
+		uint8_t bytecount = header[2];
+		
+		// only this frame is rejected, the following frames are still in sync
+		if(crc != 0) {
+			window_reply(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM, frame[0], consumed_start);
+			continue;
+		}
+		
+		if(bytecount == 0) {
+			handle_page_write(ram_page_buffer);
+			window_reply(BL_COM_REPLY_OK | BL_COM_UPLOADOK_FINISHED, frame[0], consumed_start);
+			break;
+		}
+		
+		uint16_t address_val = (header[0] << 8) | header[1];
+		if(address_val + bytecount > BL_INFO_BLSECTIONSTART) {
+			window_reply(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_ADDRESS, frame[0], consumed_start);
+			continue;
+		}
+		
+		// frames carry their address, so retransmitted frames may arrive out of order
+		set_rgb_leds(4);
+		handle_hex_data(address_val, bytecount, header + BL_COM_FRAME_HEADERLEN, ram_page_buffer);
+		
+		window_reply(BL_COM_REPLY_OK | BL_COM_UPLOADOK_LINEOK, frame[0], consumed_start);
+	}
+}
+#endif // BL_FEATURE_UPLOAD_WINDOWED
+
+#if BL_FEATURE_PAGE_WRITE || BL_FEATURE_PAGE_WRITE_COMPRESSED
+// checks the frame crc (0 when run over crc bytes too) and the page address, then programs the page
+static void finish_page_write(uint16_t crc, uint16_t address_val, uint8_t* ram_page_buffer) {
+	if(crc != 0) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
+		return;
+	}
+	
+	if((address_val & (SPM_PAGESIZE - 1)) || address_val >= BL_INFO_BLSECTIONSTART) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_ADDRESS);
+		return;
+	}
+	
+	// the reply is sent while the page is erased and written
+	set_rgb_leds(4);
+	write_flash_page(address_val, ram_page_buffer);
+	
+	USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_PAGEOK);
+}
+#endif // BL_FEATURE_PAGE_WRITE || BL_FEATURE_PAGE_WRITE_COMPRESSED
+
+#if BL_FEATURE_PAGE_WRITE
+static inline void _handle_cmd_page_write() {
+	uint8_t frame[2 + SPM_PAGESIZE + 2];
+	
+	set_rgb_leds(7);
+	uint16_t crc = receive_crc(frame, sizeof(frame), 0);
+	set_rgb_leds(6);
+	
+	finish_page_write(crc, (frame[0] << 8) | frame[1], frame + 2);
+}
+#endif // BL_FEATURE_PAGE_WRITE
+
+#if BL_FEATURE_PAGE_WRITE_COMPRESSED
+/*
+	Compressed page: addr_h, addr_l, len, stream[len], crc_h, crc_l
+	The stream is decoded into the page buffer while it is received:
+		- token 0x00 - 0x7F: token + 1 literal bytes follow
+		- token 0x80 - 0xFF: copy (token & 0x7F) + 2 bytes from (next byte) + 1 bytes back in the page (may overlap -> RLE)
+*/
+static inline void _handle_cmd_page_write_compressed() {
+	uint8_t ram_page_buffer[SPM_PAGESIZE];
+	uint8_t header[3];
+	
+	set_rgb_leds(7);
+	uint16_t crc = receive_crc(header, sizeof(header), 0);
+	
+	uint8_t pos = 0;
+	uint8_t literals = 0;
+	uint8_t match_len = 0;
+	uint8_t error = 0;
+	
+	// all len bytes are consumed even if the stream is broken, so the next frame stays in sync
+	for(uint8_t remaining = header[2]; remaining > 0; ) {
+		uint8_t* span;
+		uint8_t len = USART_ReceiveSpan(&span, remaining);
+		for(uint8_t i = 0; i < len; i++) {
+			uint8_t c = span[i];
+			crc = _crc_xmodem_update(crc, c);
+			
+			if(literals) {
+				if(pos < SPM_PAGESIZE)
+					ram_page_buffer[pos++] = c;
+				else
+					error = 1;
+				literals--;
+			} else if(match_len) {
+				if(c >= pos || match_len > SPM_PAGESIZE - pos) {
+					error = 1;
+				} else {
+					for(; match_len > 0; match_len--, pos++)
+						ram_page_buffer[pos] = ram_page_buffer[pos - c - 1];
+				}
+				match_len = 0;
+			} else if(c & 0x80) {
+				match_len = (c & 0x7F) + 2;
+			} else {
+				literals = c + 1;
+			}
+		}
+		USART_ReceiveCommit(len);
+		remaining -= len;
+	}
+	
+	crc = _crc_xmodem_update(crc, USART_Receive());
+	crc = _crc_xmodem_update(crc, USART_Receive());
+	set_rgb_leds(6);
+	
+	if(error || literals || match_len || pos != SPM_PAGESIZE) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_LINELEN);
+		return;
+	}
+	
+	finish_page_write(crc, (header[0] << 8) | header[1], ram_page_buffer);
+}
+#endif // BL_FEATURE_PAGE_WRITE_COMPRESSED
+
+#if BL_FEATURE_UPLOAD_MODE
+// how record based uploads fill pages
+static inline void _handle_cmd_upload_mode() {
+	upload_mode = USART_Receive();
+}
+#endif // BL_FEATURE_UPLOAD_MODE
+
+#if BL_FEATURE_ERASE
+static inline void _handle_cmd_erase() {
+	set_rgb_leds(LED_BLUE);
+	
+	for(uint16_t address = 0; address < BL_INFO_BLSECTIONSTART; address += SPM_PAGESIZE)
+		erase_flash_page(address);
+	flash_sync();
+	
+	USART_Transmit(BL_COM_REPLY_OK);
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_ERASE
+
+#if BL_FEATURE_PAGE_CRCS
+static inline void _handle_cmd_page_crcs() {
+	set_rgb_leds(LED_BLUE);
+	
+	flash_sync();
+	
+	USART_Transmit(BL_INFO_BLSECTIONSTART / SPM_PAGESIZE);
+	for(uint16_t page = 0; page < BL_INFO_BLSECTIONSTART; page += SPM_PAGESIZE) {
+		uint16_t crc = 0;
+		for(uint8_t i = 0; i < SPM_PAGESIZE; i++)
+			crc = _crc_xmodem_update(crc, flash_read_byte(page + i));
+		
+		USART_Transmit(crc >> 8);
+		USART_Transmit(crc);
+	}
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_PAGE_CRCS
+
+#if BL_FEATURE_VERIFY_CRC
+static inline void _handle_cmd_verify_crc() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint8_t request[4];
+	USART_ReceiveMultiple((char*)request, 4);
+	uint16_t addr = (request[0] << 8) | request[1];
+	uint16_t len = (request[2] << 8) | request[3];
+	
+	flash_sync();
+	uint32_t crc = crc32_flash(addr, len);
+	
+	for(int8_t i = 3; i >= 0; i--)
+		USART_Transmit(crc >> (8*i));
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_VERIFY_CRC
+
+#if BL_FEATURE_DUMP
+static inline void _handle_cmd_dump() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint8_t request[4];
+	USART_ReceiveMultiple((char*)request, 4);
+	uint16_t addr = (request[0] << 8) | request[1];
+	uint16_t len = (request[2] << 8) | request[3];
+	
+	flash_sync();
+	
+	// stream straight from flash, no buffer needed
+	for(; len >= 4; len -= 4, addr += 4) {
+		uint32_t dword = flash_read_dword(addr);
+		for(uint8_t i = 0; i < 4; i++) {
+			USART_Transmit(dword);
+			dword >>= 8;
+		}
+	}
+	for(; len > 0; len--, addr++)
+		USART_Transmit(flash_read_byte(addr));
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_DUMP
+
+#if BL_FEATURE_VERIFY
+static inline void _handle_cmd_verify() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint16_t addrh = (uint16_t) USART_Receive();
+	uint16_t addrl = (uint16_t) USART_Receive();
+	uint8_t num_bytes = USART_Receive();
+	
+	uint16_t addr = (addrh << 8) | addrl;
+	
+	flash_sync();
+	
+	// sent straight from flash like the dump, the TX buffer takes the bytes
+	for(; num_bytes >= 4; num_bytes -= 4, addr += 4) {
+		uint32_t dword = flash_read_dword(addr);
+		for(uint8_t i = 0; i < 4; i++) {
+			USART_Transmit(dword);
+			dword >>= 8;
+		}
+	}
+	for(; num_bytes > 0; num_bytes--, addr++)
+		USART_Transmit(flash_read_byte(addr));
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_VERIFY
+
+#if BL_FEATURE_EEPROM
+// EEPROM frame like a binary upload frame, the bytes are queued and written while the next frame arrives
+static inline void _handle_cmd_eeprom_write() {
+	uint8_t frame[BL_COM_FRAME_HEADERLEN + BL_COM_FRAME_MAXDATA + 2];
+	
+	set_rgb_leds(7);
+	uint16_t crc = receive_crc(frame, BL_COM_FRAME_HEADERLEN, 0);
+	
+	uint8_t bytecount = frame[2];
+	if(bytecount > BL_COM_FRAME_MAXDATA) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_LINELEN);
+		return;
+	}
+	
+	crc = receive_crc(frame + BL_COM_FRAME_HEADERLEN, bytecount + 2, crc);
+	set_rgb_leds(6);
+	
+	if(crc != 0) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
+		return;
+	}
+	
+	uint16_t address_val = (frame[0] << 8) | frame[1];
+	if(address_val + bytecount > BL_COM_EEPROM_APPSIZE) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_ADDRESS);
+		return;
+	}
+	
+	set_rgb_leds(4);
+	for(uint8_t i = 0; i < bytecount; i++)
+		eeprom_queue_write(address_val + i, frame[BL_COM_FRAME_HEADERLEN + i]);
+	
+	USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_LINEOK);
+}
+#endif // BL_FEATURE_EEPROM
+
+#if BL_FEATURE_APPVALID
+// the descriptor is only stored if the flash matches it, the marker is written last
+static inline void _handle_cmd_app_valid() {
+	uint8_t request[BL_COM_APPDESCRIPTOR_LEN];
+	USART_ReceiveMultiple((char*)request, BL_COM_APPDESCRIPTOR_LEN);
+	uint16_t length = (request[0] << 8) | request[1];
+	uint32_t crc = ((uint32_t) request[2] << 24) | ((uint32_t) request[3] << 16) | ((uint16_t) request[4] << 8) | request[5];
+	uint16_t version = (request[6] << 8) | request[7];
+	
+	if(length > BL_INFO_BLSECTIONSTART) {
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_ADDRESS);
+		return;
+	}
+	
+	set_rgb_leds(LED_BLUE);
+	flash_sync();
+	if(crc32_flash(0, length) != crc) {
+		// the flash isn't the image the host has, a descriptor stored earlier no longer vouches for it
+		eeprom_sync();
+		app_invalidate();
+		eeprom_busy_wait();
+		USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
+		return;
+	}
+	
+	eeprom_sync();
+	app_invalidate();
+	eeprom_write_le(BL_EEPROM_APPLENGTH, length, 2);
+	eeprom_write_le(BL_EEPROM_APPCRC, crc, 4);
+	eeprom_write_le(BL_EEPROM_APPVERSION, version, 2);
+	eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_CHECKPENDING, BL_APPVALID_MAGIC);
+	eeprom_update_byte((uint8_t*)(uintptr_t) BL_EEPROM_APPVALID, BL_APPVALID_MAGIC);
+	eeprom_busy_wait();
+	app_marker = BL_APPVALID_MAGIC;
+	
+	USART_Transmit(BL_COM_REPLY_OK);
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_APPVALID
+
+#if BL_FEATURE_EEPROM
+static inline void _handle_cmd_eeprom_crc() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint8_t request[4];
+	USART_ReceiveMultiple((char*)request, 4);
+	uint16_t addr = (request[0] << 8) | request[1];
+	uint16_t len = (request[2] << 8) | request[3];
+	
+	eeprom_sync();
+	uint32_t crc = crc32_eeprom(addr, len);
+	
+	for(int8_t i = 3; i >= 0; i--)
+		USART_Transmit(crc >> (8*i));
+	
+	set_rgb_leds(LED_GREEN);
+}
+
+static inline void _handle_cmd_eeprom_dump() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint8_t request[4];
+	USART_ReceiveMultiple((char*)request, 4);
+	uint16_t addr = (request[0] << 8) | request[1];
+	uint16_t len = (request[2] << 8) | request[3];
+	
+	eeprom_sync();
+	for(; len > 0; len--, addr++)
+		USART_Transmit(eeprom_read_byte((const uint8_t*)(uintptr_t) addr));
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_EEPROM
+
+#if BL_FEATURE_FUSES
+static inline void _handle_cmd_fuses() {
+	set_rgb_leds(LED_BLUE);
+	
+	uint8_t fuses_lo = boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
+	uint8_t fuses_hi = boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
+	uint8_t fuses_ex = boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
+	uint8_t locks = boot_lock_fuse_bits_get(GET_LOCK_BITS);
+	
+	USART_Transmit(fuses_lo);
+	USART_Transmit(fuses_hi);
+	USART_Transmit(fuses_ex);
+	USART_Transmit(locks);
+	
+	set_rgb_leds(LED_GREEN);
+}
+#endif // BL_FEATURE_FUSES
+
+#if BL_FEATURE_SETBAUD
+static inline void _handle_cmd_set_baud() {
+	uint8_t index = USART_Receive();
+	if(index >= BL_COM_BAUD_COUNT) {
+		USART_Transmit(BL_COM_REPLY_INVALIDARG);
+		return;
+	}
+	
+	uint16_t ubrr = pgm_read_word(&baud_table[index]);
+	USART_TransmitAndDrain(BL_COM_REPLY_OK);
+	USART_SetBaud(ubrr & ~BAUD_TABLE_U2X, ubrr & BAUD_TABLE_U2X ? 1 : 0);
+	
+	// the host has to prove that the new rate works, garbage or silence means rollback
+	char confirm;
+	for(uint8_t i = 0; i < 4; i++) {
+		if(USART_ReceiveTimeout(&confirm, BL_COM_BAUD_CONFIRMTIMEOUT_MS))
+			break;
+		if(confirm == BL_COM_CMD_SETBAUD) {
+			baud_current = ubrr;
+			USART_Transmit(BL_COM_REPLY_OK);
+			return;
+		}
+	}
+	
+	USART_SetBaud(baud_current & ~BAUD_TABLE_U2X, baud_current & BAUD_TABLE_U2X ? 1 : 0);
+	USART_DiscardRX(10);
+}
+#endif // BL_FEATURE_SETBAUD
+
+#if BL_FEATURE_FLOWCONTROL
+static inline void _handle_cmd_flow_control() {
+	uint8_t mode = USART_Receive();
+	if(USART_SetFlowControl(mode))
+		USART_Transmit(BL_COM_REPLY_INVALIDARG);
+	else
+		USART_Transmit(BL_COM_REPLY_OK);
+}
+#endif // BL_FEATURE_FLOWCONTROL
+
+static inline void _handle_cmd_info() {
+	USART_Transmit(sizeof(BL_INFO_VERSION) - 1);
+	USART_TransmitString(BL_INFO_VERSION);
+	
+	USART_Transmit(sizeof(bl_sectionstartaddress));
+	for(uint8_t i = 0; i < sizeof(bl_sectionstartaddress); i++) {
+		USART_Transmit((uint8_t) (bl_sectionstartaddress >> (8*i)) );
+	}
+	
+	USART_Transmit(sizeof(bl_features));
+	USART_Transmit((uint8_t) bl_features);
+	USART_Transmit((uint8_t) (bl_features >> 8));
+}
+
+// echo the nonce, the host discards everything before OK + nonce
+static inline void _handle_cmd_sync() {
+	// a new session, a mode set by an aborted one doesn't apply anymore
+	upload_mode_reset();
+	char nonce[BL_COM_SYNC_NONCELEN];
+	if(USART_ReceiveMultipleTimeout(nonce, BL_COM_SYNC_NONCELEN, BL_COM_SYNC_TIMEOUT_MS))
+		return;
+	USART_TransmitMultiple(nonce, BL_COM_SYNC_NONCELEN);
+}
+
+struct bl_command {
+	char code;
+	void (*handler)();
+};
+
+// every command except 'q', the dispatcher sends BL_COM_REPLY_OK before calling the handler
+const struct bl_command bl_commands[] PROGMEM = {
+	// resynchronise with the host
+	{BL_COM_CMD_SYNC, _handle_cmd_sync},
+	// Send information about the bootloader: Version, Boot Section Start Address, Features
+	{BL_COM_CMD_INFO, _handle_cmd_info},
+#if BL_FEATURE_PAGE_WRITE
+	// write one complete flash page
+	{BL_COM_CMD_PAGEWRITE, _handle_cmd_page_write},
+#endif
+#if BL_FEATURE_VERIFY_CRC
+	// crc over a flash range
+	{BL_COM_CMD_VERIFYCRC, _handle_cmd_verify_crc},
+#endif
+#if BL_FEATURE_FUSES
+	// read low, high, extended fuse bytes
+	{BL_COM_CMD_READFUSES, _handle_cmd_fuses},
+#endif
+#if BL_FEATURE_UPLOAD_HEX
+	// upload program
+	{BL_COM_CMD_UPLOAD, _handle_cmd_upload},
+#endif
+#if BL_FEATURE_UPLOAD_BINARY
+	// upload program as binary frames
+	{BL_COM_CMD_UPLOADBINARY, _handle_cmd_upload_binary},
+#endif
+#if BL_FEATURE_UPLOAD_WINDOWED
+	// upload program as binary frames with several frames in flight
+	{BL_COM_CMD_UPLOADWINDOWED, _handle_cmd_upload_windowed},
+#endif
+#if BL_FEATURE_UPLOAD_MODE
+	// select how record based uploads fill pages
+	{BL_COM_CMD_UPLOADMODE, _handle_cmd_upload_mode},
+#endif
+#if BL_FEATURE_ERASE
+	// erase the application section
+	{BL_COM_CMD_ERASE, _handle_cmd_erase},
+#endif
+#if BL_FEATURE_PAGE_WRITE_COMPRESSED
+	// write one compressed flash page
+	{BL_COM_CMD_PAGEWRITECOMPRESSED, _handle_cmd_page_write_compressed},
+#endif
+#if BL_FEATURE_PAGE_CRCS
+	// crc of every application page
+	{BL_COM_CMD_PAGECRCS, _handle_cmd_page_crcs},
+#endif
+#if BL_FEATURE_DUMP
+	// stream a flash range
+	{BL_COM_CMD_DUMP, _handle_cmd_dump},
+#endif
+#if BL_FEATURE_VERIFY
+	// verify memory
+	{BL_COM_CMD_VERIFY, _handle_cmd_verify},
+#endif
+#if BL_FEATURE_SETBAUD
+	// switch to another baudrate
+	{BL_COM_CMD_SETBAUD, _handle_cmd_set_baud},
+#endif
+#if BL_FEATURE_EEPROM
+	// write an EEPROM block, crc over / stream an EEPROM range
+	{BL_COM_CMD_EEPROMWRITE, _handle_cmd_eeprom_write},
+	{BL_COM_CMD_EEPROMCRC, _handle_cmd_eeprom_crc},
+	{BL_COM_CMD_EEPROMDUMP, _handle_cmd_eeprom_dump},
+#endif
+#if BL_FEATURE_APPVALID
+	// mark the application as valid
+	{BL_COM_CMD_APPVALID, _handle_cmd_app_valid},
+#endif
+#if BL_FEATURE_FLOWCONTROL
+	// select the flow control
+	{BL_COM_CMD_FLOWCONTROL, _handle_cmd_flow_control},
+#endif
+};
+#define BL_COMMAND_COUNT (sizeof(bl_commands) / sizeof(bl_commands[0]))
+
+// command loop, returns when the host quits the bootloader
+void bootloader_run() {
+	// prepare bootloader globals
+#if BL_RECORD_UPLOAD
+	page_start_address = 0;
+	next_page_start_address = SPM_PAGESIZE;
+	page_used = 0;
+#endif // BL_RECORD_UPLOAD
+#if BL_FEATURE_APPVALID
+	app_marker = eeprom_read_byte((const uint8_t*)(uintptr_t) BL_EEPROM_APPVALID);
+#endif // BL_FEATURE_APPVALID
+	
+	while(1) {
+		set_rgb_leds(LED_RED); // waiting for input
+		char code = USART_Receive();
+		set_rgb_leds(LED_GREEN);
+		
+		// the RX buffer overflowed since the last command (no or ignored flow control), neither the command nor
+		// what follows can be trusted: the input is dropped and the host gets the error instead of a reply
+		if(USART_Overrun()) {
+			USART_DiscardRX(BL_COM_UPLOAD_DISCARDTIMEOUT_MS);
+			(void) USART_Overrun(); // bytes dropped while discarding
+			USART_Transmit(BL_COM_REPLY_RXOVERRUN);
+			continue;
+		}
+		
+		// Quit bootloader
+		if(code == BL_COM_CMD_QUIT) {
+			set_rgb_leds(LED_BLUE);
+			app_session_end();
+			USART_Transmit(BL_COM_REPLY_QUITTING);
+			return;
+		}
+		
+		const struct bl_command* command = bl_commands;
+		while(command < bl_commands + BL_COMMAND_COUNT && pgm_read_byte(&command->code) != code)
+			command++;
+		
+		if(command < bl_commands + BL_COMMAND_COUNT) {
+			USART_Transmit(BL_COM_REPLY_OK);
+			((void (*)()) pgm_read_ptr(&command->handler))();
+		} else {
+			// Unknown command
+			USART_Transmit(BL_COM_REPLY_UNKNOWNCMD);
+			USART_Transmit(code);
+		}
+		set_rgb_leds(LED_GREEN);
+	}
+}
+
+#endif /* BOOTLOADER_CORE_H_ */
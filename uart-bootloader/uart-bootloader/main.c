@@ -7,7 +7,10 @@
 
 #define F_CPU 16000000
 #define BL_INFO_VERSION "0.1"
+// the Makefile passes the start of the selected boot section (BOOTSZ)
+#ifndef BL_INFO_BLSECTIONSTART
 #define BL_INFO_BLSECTIONSTART (2 * 0x3800)
+#endif
 
 /*
 
@@ -40,6 +43,9 @@ high fuse byte:		11011010 --larger bls--> 0b11011000 = 0xD8
 			- 2048 words boot (= 64 pages)
 			- Application Flash: 0x0000 - 0x37FF
 			- Bootloader Flash:  0x3800 - 0x3FFF
+		=> smaller profiles (bootloader-config.h): BOOTSZ = 01 / 10 / 11 for 1024 / 512 / 256 words,
+		   high fuse 0xDA / 0xDC / 0xDE, the application section grows to 0x3BFF / 0x3DFF / 0x3EFF.
+		   make size-report shows the smallest section a profile fits into
 	
 low fuse byte:		11111111
 
@@ -57,13 +63,18 @@ Memory Information (see atmega datasheet):
 */
 
 #include "bootloader-communication.h"
+#include "bootloader-config.h"
 
 /*
 	Configuration options for the bootloader before compilation:
 	
 Boot Loader Enable (BLE) Type: How does the bootloader know to continue execution or to directly switch to the application?
 	- Bootmode Enable Switch / Button
-	- Always (with timeouts)
+	- Always (with timeouts): after a power-on or brown-out reset an application marked as valid (see BL_COM_CMD_APPVALID)
+	  is started right away. Otherwise the bootloader waits BL_ENTRY_WINDOW_MS for the host and starts the application if
+	  nothing arrives, unmarked applications (uploaded without verification, flashed by ISP, ...) included.
+	  It stays in the bootloader if a marked application fails its BL_BOOT_CHECK or if a session changed the flash
+	  and didn't end with 'a' or 'q' (torn upload, BL_APPVALID_INCOMPLETE).
 	- ... (to be extended)
 
 Boot Loader Enable Switch Pin: If BLE Type is switch, define pin and ports here
@@ -75,6 +86,14 @@ Boot Loader Enable Switch Pin: If BLE Type is switch, define pin and ports here
 #define BLE_ALWAYS 2
 #define BL_ENABLE_TYPE BLE_ALWAYS
 
+// BLE Always: how long the host has to send its first byte (50 - 500 ms)
+#define BL_ENTRY_WINDOW_MS 250
+
+// CRC check of a marked application against its descriptor before it is started (BL_BOOT_CHECK_NONE / _FIRST / _ALWAYS)
+// FIRST only checks the first start after the descriptor was written, ALWAYS adds the CRC time to every start
+// (ALWAYS uses the 256 entry CRC table, about 45 ms for 28 KB instead of 125 ms, estimated from the instruction count)
+#define BL_BOOT_CHECK BL_BOOT_CHECK_FIRST
+
 // BLE Switch
 #define BLE_SWITCH_DDRX DDRB
 #define BLE_SWITCH_DDRXn DDB0
@@ -83,372 +102,106 @@ Boot Loader Enable Switch Pin: If BLE Type is switch, define pin and ports here
 #define BLE_SWITCH_PINX PINB
 #define BLE_SWITCH_PINXn PINB0
 
-#define BL_PREFIX "[BL] "
+// RTS / CTS flow control, only active when the tool selects it (--flow rtscts)
+// RTS: output, low while the bootloader can receive; CTS: input with pullup, the bootloader only sends while it is low
+#define USART_RTS_DDRX DDRD
+#define USART_RTS_DDRXn DDD4
+#define USART_RTS_PORTX PORTD
+#define USART_RTS_PORTXn PORTD4
+#define USART_CTS_PINX PIND
+#define USART_CTS_PINXn PIND3
+#define USART_CTS_PORTX PORTD
+#define USART_CTS_PORTXn PORTD3
 
-// Red, Green, Blue Test LEDs
-#define LED_RED	1
-#define LED_GREEN 2
-#define LED_BLUE 4
+#define BL_PREFIX "[BL] "
 
-// hex file decoding
-#define HEX_RTYPE_DATARECORD 0
-#define HEX_RTYPE_EOF 1
-#define HEX_RTYPE_STARTSEGMENTADDRESSRECORD 3
+#if !BL_FEATURE_FLOWCONTROL
+#define USART_NO_FLOWCONTROL
+#endif
+#if !BL_FEATURE_USART_BUFFERED
+#define USART_POLLED
+#endif
 
 #include <stdint.h>
 #include <avr/io.h>
 #include <avr/boot.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
-#include <alloca.h>
 #include <avr/pgmspace.h>
+#include <avr/wdt.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
-#define BAUDRATE 19200
-#include "MyUSART.h"
+// keep the flash programming and EEPROM writes going while waiting for UART data
+void bl_idle();
+#define USART_RX_IDLE() bl_idle()
 
-volatile uint16_t page_start_address = 0;
-volatile uint16_t next_page_start_address = SPM_PAGESIZE;
-volatile uint8_t page_used = 0;
-
-uint8_t* const bl_sectionstartaddress = (uint8_t* const) BL_INFO_BLSECTIONSTART;
+#define BAUDRATE BL_COM_BAUD_0
+#include "MyUSART.h"
 
+#if BL_FEATURE_DEMOAPP
 __attribute__ ((section (".application"))) int application();
+#else
+// the uploaded application starts at its reset vector
+#define application() ((void (*)(void)) 0x0000)()
+#endif // BL_FEATURE_DEMOAPP
 
 
+#if BL_FEATURE_LEDS
 void set_rgb_leds(uint8_t flag) {
 	uint8_t temp = PORTD;
 	temp &= ~(1<<PORTD5) & ~(1<<PORTD6) & ~(1<<PORTD7);
 	temp |= (flag & 0b111) << 5;
 	PORTD = temp;
 }
+#else
+#define set_rgb_leds(flag)
+#endif // BL_FEATURE_LEDS
 
-static inline void handle_page_write(uint8_t* ram_page_buffer) {
-	uint16_t counter = 0;
-	if(page_used) {
-		// write page
-		for(counter = 0; counter < SPM_PAGESIZE; counter += 2) {
-			boot_spm_busy_wait();
-			boot_page_fill(counter, ram_page_buffer[counter + 1] << 8 | ram_page_buffer[counter]);
-		}
-		
-		boot_spm_busy_wait();
-		boot_page_erase(page_start_address);
-		boot_spm_busy_wait();
-		boot_page_write(page_start_address);
-		boot_spm_busy_wait();
-	}
-}
-
-void handle_hex_data(uint16_t addr, uint8_t bytecount, uint8_t* data_buf, uint8_t* ram_page_buffer) {
-	uint8_t sreg;
-	
-	sreg = SREG;
-	cli();
-	
-	uint16_t address_offset = 0;
-	uint16_t counter = 0;
-	
-	// new data starts in current page
-	if(addr >= page_start_address && addr < next_page_start_address) {
-		if(!page_used) {
-			// enable reading (page write & erase will disable this)
-			boot_spm_busy_wait();
-			boot_rww_enable();
-			
-			// fill temporary page buffer with current content of new page
-			for(counter = 0; counter < SPM_PAGESIZE; counter++) {
-				ram_page_buffer[counter] = pgm_read_byte(page_start_address + counter);
-			}
-			page_used = 1;
-		}
-		
-		address_offset = addr - page_start_address;
-		for(counter = 0; counter < bytecount && addr + counter < next_page_start_address; counter++) {
-			// write word to temporary page buffer
-			ram_page_buffer[address_offset + counter] = data_buf[counter];
-		}
-		
-		// handle data that spans over multiple pages
-		if(addr + bytecount - 1 >= next_page_start_address) {
-			uint16_t overlap = addr + bytecount - next_page_start_address;
-			handle_hex_data(next_page_start_address, overlap, data_buf + bytecount - overlap, ram_page_buffer);
-		}
-		
-	} else {
-		handle_page_write(ram_page_buffer);
-		
-		page_start_address = addr & ~(SPM_PAGESIZE - 1);
-		next_page_start_address = page_start_address + SPM_PAGESIZE;
-		page_used = 0;
-		
-		handle_hex_data(addr, bytecount, data_buf, ram_page_buffer);
-	}
-	
-	SREG = sreg;
-}
-
-uint8_t get_hex_val_8(uint8_t* hexval, uint8_t* read_buffer, uint8_t start) {
-	if(read_buffer[start] >= 'A' && read_buffer[start] <= 'F') {
-		*hexval = 0xA + (read_buffer[start] - 'A');
-	} else if(read_buffer[start] >= '0' && read_buffer[start] <= '9') {
-		*hexval = read_buffer[start] - '0';
-	} else {
-		return 1;
-	}
-	
-	*hexval = *hexval << 4;
-	
-	if(read_buffer[start + 1] >= 'A' && read_buffer[start + 1] <= 'F') {
-		*hexval += 0xA + (read_buffer[start + 1] - 'A');
-	} else if(read_buffer[start + 1] >= '0' && read_buffer[start +1] <= '9') {
-		*hexval += read_buffer[start + 1] - '0';
-	} else {
-		return 1;
-	}
-	
-	return 0;
-}
-
-uint8_t get_hex_val_16(uint16_t* hexval, uint8_t* read_buffer, uint8_t start) {
-	if(get_hex_val_8((uint8_t*) hexval + 1, read_buffer, start) || get_hex_val_8((uint8_t*) hexval, read_buffer, start + 2)) {
-		return 1;
-	}
-	return 0;
-}
+// protocol and flash programming
+#include "bootloader-core.h"
 
-static inline void _handle_cmd_upload() {
-	uint8_t ram_page_buffer[SPM_PAGESIZE];
-	
-	set_rgb_leds(0);
-					
-	uint8_t upload_running = 1;
-	while(upload_running) {
-		set_rgb_leds(7);
-		uint8_t read_buffer[9];
-		USART_ReceiveMultiple((char*)read_buffer, 9);
-						
-		if(read_buffer[0] != ':') {
-			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_COLON);
-			upload_running = 0;
-			break;
-		}
-						
-		uint8_t bytecount;
-		if(get_hex_val_8(&bytecount, read_buffer, 1)) {
-			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_8);
-			upload_running = 0;
-			break;
-		}
-						
-		uint8_t rtype;
-		if(get_hex_val_8(&rtype, read_buffer, 7)) {
-			USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_8);
-			upload_running = 0;
-			break;
-		}
-						
-		USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_HEADEROK);
-		set_rgb_leds(6);
-						
-		uint8_t* data_buf = alloca(bytecount * 2 + 2);
-		USART_ReceiveMultiple((char*)data_buf, bytecount * 2 + 2);
-						
-		set_rgb_leds(5);
-						
-		switch(rtype) {
-			case HEX_RTYPE_EOF: {
-								
-				uint16_t address_val;
-				if(get_hex_val_16(&address_val, read_buffer, 3)) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_16);
-					upload_running = 0;
-					break;
-				}
-								
-				uint8_t checksum_val;
-				if(get_hex_val_8(&checksum_val, data_buf, 0)) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_16);
-					upload_running = 0;
-					break;
-				}
-								
-				uint8_t checksum = 0;
-				checksum += bytecount;
-				checksum += rtype;
-				checksum += (uint8_t) (address_val >> 8);
-				checksum += (uint8_t) address_val;
-				checksum += checksum_val;
-								
-				if(checksum != 0) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
-					upload_running = 0;
-					break;
-				}
-								
-				handle_page_write(ram_page_buffer);
-				USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_FINISHED);
-				upload_running = 0;
-				break;
-			}
-			case HEX_RTYPE_STARTSEGMENTADDRESSRECORD: {
-				/*
-				uint16_t address_val;
-				if(get_hex_val_16(&address_val, read_buffer, 3)) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_16);
-					upload_running = 0;
-					break;
-				}
-								
-				uint8_t checksum_val;
-				if(get_hex_val_8(&checksum_val, data_buf, 0)) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_16);
-					upload_running = 0;
-					break;
-				}
-								
-				uint8_t checksum = 0;
-				checksum += bytecount;
-				checksum += rtype;
-				checksum += (uint8_t) (address_val >> 8);
-				checksum += (uint8_t) address_val;
-				checksum += checksum_val;
-								
-				if(checksum != 0) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
-					upload_running = 0;
-					break;
-				}
-				*/
-								
-				USART_Transmit(BL_COM_REPLY_OK);
-				break;
-			}
-			case HEX_RTYPE_DATARECORD: {
-				uint16_t address_val;
-				if(get_hex_val_16(&address_val, read_buffer, 3)) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_16);
-					upload_running = 0;
-					break;
-				}
-																
-				uint8_t checksum = 0;
-				for(uint8_t i = 0; i < bytecount + 1; i++) { // + 1: checksum
-					uint8_t byte;
-					if(get_hex_val_8(&byte, data_buf, 2*i)) {
-						USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_HEXVAL_8);
-						upload_running = 0;
-						break;
-					}
-					data_buf[i] = byte;
-					checksum += byte;
-				}
-								
-				// checksum check
-				checksum += bytecount;
-				checksum += rtype;
-				checksum += (uint8_t) (address_val >> 8);
-				checksum += (uint8_t) address_val;
-								
-				if(checksum != 0) {
-					USART_Transmit(BL_COM_REPLY_UPLOADERROR | BL_COM_UPLOADERR_CHECKSUM);
-					upload_running = 0;
-					break;
-				}
-								
-				set_rgb_leds(4);
-								
-				// TODO: handle data upload pagewise
-								
-				handle_hex_data(address_val, bytecount, data_buf, ram_page_buffer);
-								
-				USART_Transmit(BL_COM_REPLY_OK | BL_COM_UPLOADOK_LINEOK);
-			}
-		}
-	}
-}
 
-static inline void _handle_cmd_verify() {
-	set_rgb_leds(LED_BLUE);
-	
-	uint16_t addrh = (uint16_t) USART_Receive();
-	uint16_t addrl = (uint16_t) USART_Receive();
-	uint8_t num_bytes = USART_Receive();
-	
-	uint8_t* addr = (uint8_t*) ((addrh << 8) | addrl);
-	uint8_t* buffer = (uint8_t*) alloca(num_bytes);
-	uint8_t buffer_counter = 0;
-	
-	boot_spm_busy_wait();
-	boot_rww_enable();
-	
-	while(buffer_counter < num_bytes) {
-		if(num_bytes == 1) {
-			// read byte
-			uint8_t byte = pgm_read_byte(addr + buffer_counter);
-			buffer[buffer_counter] = byte;
-			buffer_counter += 1;
-			} else if(num_bytes == 2 || num_bytes == 3) {
-			// read word
-			uint16_t word = pgm_read_word(addr + buffer_counter);
-			uint8_t* byte_buf = (uint8_t*) &word;
-			buffer[buffer_counter] = byte_buf[0];
-			buffer[buffer_counter + 1] = byte_buf[1];
-			buffer_counter += 2;
-			} else {
-			// read dword
-			uint32_t dword = pgm_read_dword(addr + buffer_counter);
-			uint8_t* byte_buf = (uint8_t*) &dword;
-			buffer[buffer_counter] = byte_buf[0];
-			buffer[buffer_counter + 1] = byte_buf[1];
-			buffer[buffer_counter + 2] = byte_buf[2];
-			buffer[buffer_counter + 3] = byte_buf[3];
-			buffer_counter += 4;
-		}
-	}
-	
-	set_rgb_leds(LED_GREEN);
-	
-	for(uint8_t i = 0; i < num_bytes; i++)
-		USART_Transmit(buffer[i]);
+#ifdef BL_NO_STARTFILES
+/*
+	Entry without the C runtime (-nostartfiles), there is no vector table: .vectors only holds the jump to bl_init.
+	The linker script places the .progmem tables between .vectors and the .init sections, bl_init (.init2) falls
+	through to the .data / .bss setup libgcc adds in .init4 if there is any and to the jump to main() in .init9.
+*/
+__attribute__((naked, used, section(".vectors"))) void bl_reset() {
+	asm volatile("rjmp bl_init");
 }
 
-static inline void _handle_cmd_fuses() {
-	set_rgb_leds(LED_BLUE);
-	
-	uint8_t fuses_lo = boot_lock_fuse_bits_get(GET_LOW_FUSE_BITS);
-	uint8_t fuses_hi = boot_lock_fuse_bits_get(GET_HIGH_FUSE_BITS);
-	uint8_t fuses_ex = boot_lock_fuse_bits_get(GET_EXTENDED_FUSE_BITS);
-	uint8_t locks = boot_lock_fuse_bits_get(GET_LOCK_BITS);
-	
-	USART_Transmit(fuses_lo);
-	USART_Transmit(fuses_hi);
-	USART_Transmit(fuses_ex);
-	USART_Transmit(locks);
-	
-	set_rgb_leds(LED_GREEN);
+__attribute__((naked, used, section(".init2"))) void bl_init() {
+	asm volatile("clr __zero_reg__");
+	// also after a jump from the application
+	SP = RAMEND;
 }
 
-static inline void _handle_cmd_info() {
-	USART_Transmit(sizeof(BL_INFO_VERSION) - 1);
-	USART_TransmitString(BL_INFO_VERSION);
-	
-	USART_Transmit(sizeof(bl_sectionstartaddress));
-	for(uint8_t i = 0; i < sizeof(bl_sectionstartaddress); i++) {
-		USART_Transmit((uint8_t) ((uint16_t)bl_sectionstartaddress >> (8*i)) );
-	}
+__attribute__((naked, used, section(".init9"))) void bl_start() {
+	asm volatile("jmp main");
 }
-
+#endif // BL_NO_STARTFILES
 
 // bootloader entry
 int main() {
+#ifndef BL_NO_STARTFILES
 	uint8_t temp;
+#endif // BL_NO_STARTFILES
 	
+	// a watchdog reset leaves the watchdog running
+	uint8_t reset_flags = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+	
+#ifndef BL_NO_STARTFILES
 	// select bootloader interrupt vector
 	cli();
 	temp = MCUCR;
 	MCUCR = temp | (1<<IVCE);
 	MCUCR = temp | (1<<IVSEL);
 	sei();
+#endif // BL_NO_STARTFILES
 	
 	// disable SPM for the bootloader section
 	//boot_lock_bits_set (_BV (BLB11));
@@ -457,94 +210,56 @@ int main() {
 	BLE_SWITCH_DDRX &= (1<<BLE_SWITCH_DDRXn);
 	BLE_SWITCH_PORTX |= (1<<BLE_SWITCH_PORTXn); // enable pullup
 	
-	// prepare bootloader globals
-	page_start_address = 0;
-	next_page_start_address = SPM_PAGESIZE;
-	page_used = 0;
-	
-	
 	// check if boot mode should be entered
 #if BL_ENABLE_TYPE == BLE_BUTTON
-	if(!(BLE_SWITCH_PINX & (1<<BLE_SWITCH_PINXn))) {
-#else // BL_ENABLE_TYPE == BLE_ALWAYS
+	if(!(BLE_SWITCH_PINX & (1<<BLE_SWITCH_PINXn)) || app_broken()) {
+#elif BL_FEATURE_APPVALID // BL_ENABLE_TYPE == BLE_ALWAYS
+	uint8_t application_broken = app_broken();
+	if(!app_valid() || application_broken || !(reset_flags & ((1<<PORF) | (1<<BORF)))) {
+#else // BL_ENABLE_TYPE == BLE_ALWAYS without the marker: every reset opens the entry window
+	const uint8_t application_broken = 0;
+	(void) reset_flags;
 	{
 #endif // BL_ENABLE_TYPE == BLE_BUTTON
+#if BL_FEATURE_LEDS
 		DDRB |= (1<<DDB5);
 		DDRD |= (1<<DDD5) | (1<<DDD6) | (1<<DDD7);
+#endif // BL_FEATURE_LEDS
 		
 		USART_Init();
 		
 		USART_Transmit(BL_COM_BL_READY);
 		
-		uint8_t bl_run = 1;
-		while(bl_run) {
-			set_rgb_leds(LED_RED); // waiting for input
-			char code = USART_Receive();
-			set_rgb_leds(LED_GREEN);
-			switch(code) {
-			// Quit bootloader
-				case 'q': {
-					set_rgb_leds(LED_BLUE);
-					USART_Transmit(BL_COM_REPLY_QUITTING);
-					bl_run = 0;
-					break;
-				}
-				// Send information about the bootloader: Version, Boot Section Start Address
-				case 'i': {
-					USART_Transmit(BL_COM_REPLY_OK);
-					_handle_cmd_info();
-					
-					break;
-				}
-				// read low, high, extended fuse bytes
-				case 'f': {
-					USART_Transmit(BL_COM_REPLY_OK);
-					_handle_cmd_fuses();	
-								
-					break;
-				}
-				// upload program
-				case 'u': {
-					USART_Transmit(BL_COM_REPLY_OK);
-					_handle_cmd_upload();
-					
-					break;
-				}
-				// verify memory
-				case 'v': {
-					USART_Transmit(BL_COM_REPLY_OK);
-					_handle_cmd_verify();
-					
-					break;
-				}
-				// Unknown command
-				default: {
-					USART_Transmit(BL_COM_REPLY_UNKNOWNCMD);
-					USART_Transmit(code);
-					break;
-				}
-			}
-			set_rgb_leds(LED_GREEN);
-		}
-		_delay_ms(50);
-		USART_AwaitTX();
+#if BL_ENABLE_TYPE == BLE_ALWAYS
+		// the first byte of the host stays in the buffer for the command loop
+		if(application_broken || !USART_AwaitRX(BL_ENTRY_WINDOW_MS))
+#endif // BL_ENABLE_TYPE == BLE_ALWAYS
+			bootloader_run();
+		
+		// the quit reply and everything else still queued
+		USART_Flush();
 	}
 	
 	// TODO: reset all peripherals to default settings
 	
-	// enable rww section
+	// finish programming and enable rww section
+	eeprom_sync();
+	flash_sync();
 	boot_rww_enable_safe();
 	
+#ifndef BL_NO_STARTFILES
 	// select application interrupt vector
 	cli();
 	temp = MCUCR;
 	MCUCR = temp | (1<<IVCE);
 	MCUCR = temp & ~(1<<IVSEL);
+#endif // BL_NO_STARTFILES
 	
 	cli();
 	application();
 }
 
+#if BL_FEATURE_DEMOAPP
 int application() {
 	uint8_t counter = 0;
 	
@@ -569,4 +284,5 @@ int application() {
 		
 		set_rgb_leds(counter);
 	}
-}
\ No newline at end of file
+}
+#endif // BL_FEATURE_DEMOAPP
@@ -1,17 +1,48 @@
 from serial import Serial, SerialException 
 import argparse
 import os
-import argparse
+import contextlib
+import json
 import re
-import pprint
+import sys
+import threading
 import time
+import binascii
+import zlib
+import hashlib
+import pickle
 from termcolor import colored
 
 TOOL_VERSION = "0.1"
 
-RT_DATARECORD = '00'
-RT_EOF = '01'
-RT_STARTSEGMENTADDRESSRECORD = '03'
+RT_DATARECORD = 0x00
+RT_EOF = 0x01
+RT_EXTSEGMENTADDRESSRECORD = 0x02
+RT_STARTSEGMENTADDRESSRECORD = 0x03
+RT_EXTLINEARADDRESSRECORD = 0x04
+RT_STARTLINEARADDRESSRECORD = 0x05
+
+IMAGE_CACHE_VERSION = 1
+IMAGE_CACHE_DIR = os.path.join(os.path.expanduser('~'), '.cache', 'atmega328p-uploader')
+
+# upper bounds of the round trip histogram buckets in ms, the last bucket is open
+RTT_BUCKETS_MS = [1, 2, 5, 10, 20, 50, 100, 200, 500, 1000]
+
+class DeviceStats(threading.local):
+    '''phase times and error counters for --stats, one set per thread so the sessions of --ports don't mix'''
+    def __init__(self):
+        self.counters = {'phases': {}, 'naks': 0, 'retries': 0}
+        # time spent in nested phases per running phase, see timed_phase()
+        self.nested = []
+
+    def __getitem__(self, name):
+        return self.counters[name]
+
+    def __setitem__(self, name, value):
+        self.counters[name] = value
+
+# the upload functions count NAKs and retransmissions
+stats = DeviceStats()
 
 def decode_fuse_ext(fuse):
     f_bod210 = fuse & 7
@@ -158,74 +189,220 @@ def serial_send_code(ser: Serial, code):
     ser.write(comdefines[code])
     return int.from_bytes(ser.read(size=1))
 
-def verify_program(ser, hexfile, comdefines, args):
+def verify_program(ser, image, comdefines, args, readback=False):
     print()
     print('Verifying memory...')
-    pagecounter = 0
     num_errors = 0
-    for line in hexfile['data']:
-        status = serial_send_code(ser, 'BL_COM_CMD_VERIFY')
+    # one crc request per contiguous range, read back only the ranges that differ
+    for (address, data) in image_ranges(image):
+        if(readback):
+            # bootloader without crcs
+            num_errors += verify_program_readback(ser, address, data, comdefines, args)
+            continue
+        ser.write(comdefines['BL_COM_CMD_VERIFYCRC'] + address.to_bytes(2, byteorder='big') + len(data).to_bytes(2, byteorder='big'))
+        status = int.from_bytes(ser.read(size=1))
+        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+            print(f'Error: verify crc request returned: {status}')
+            num_errors += 1
+            break
 
-        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
-            # request hex file data
-            (bytecount, address, data, checksum_ok, data_binary) = line
+        device_crc = int.from_bytes(ser.read(size=4), byteorder='big')
+        if(args.verbose):
+            print(f'0x{address:04X} - 0x{address + len(data) - 1:04X}: crc 0x{device_crc:08X} ', end='')
+        if(device_crc == zlib.crc32(data)):
+            if(args.verbose):
+                print('OK')
+        else:
+            if(args.verbose):
+                print(f'should be 0x{zlib.crc32(data):08X}, reading back...')
+            num_errors += verify_program_readback(ser, address, data, comdefines, args)
 
-            addrh = (address >> 8) & 0xFF
-            addrl = address & 0xFF
+    if(num_errors == 0):
+        print('\t=> No errors detected!')
+    else:
+        print(f'\t=> Errors detected: {num_errors}')
+    return num_errors == 0
 
-            # is
-            if(args.verbose):
-                print(f'0x{addrh:02X}{addrl:02X} | {bytecount:2} | ', end='')
+def verify_program_readback(ser, address, data, comdefines, args):
+    memory = read_flash(ser, address, len(data), comdefines)
+    if(memory is None):
+        return 1
 
-            ser.write(addrh.to_bytes(1))
-            ser.write(addrl.to_bytes(1))
-            ser.write(bytecount.to_bytes(1))
+    num_errors = 0
+    for offset in range(0, len(data), 16):
+        row = data[offset:offset + 16]
+        memory_row = memory[offset:offset + 16]
 
-            memory_data = ser.read(size=bytecount)
+        # is
+        if(args.verbose):
+            print(f'0x{address + offset:04X} | {len(row):2} | ', end='')
 
-            error_detected = False
-            
-            for i, byte in enumerate(memory_data):
-                if(args.verbose):
-                    print(f'{byte:02X} ', end='')
-                if(byte != data_binary[i]):
-                    num_errors += 1
-                    error_detected = True
+        error_detected = False
+        
+        for i, byte in enumerate(memory_row):
             if(args.verbose):
+                print(f'{byte:02X} ', end='')
+            if(byte != row[i]):
+                num_errors += 1
+                error_detected = True
+        if(args.verbose):
+            print()
+
+        # should
+        if(error_detected):
+            if(args.verbose):
+                print('should be     ', end='')
+                for byte in row:
+                    print(colored(f'{byte:02X} ', 'red'), end='')
+                print()
                 print()
 
-            # should
-            if(error_detected):
-                if(args.verbose):
-                    print('should be     ', end='')
+    if(args.verbose): 
+        print() 
+    return num_errors
+
+def read_flash(ser, address, length, comdefines):
+    ser.write(comdefines['BL_COM_CMD_DUMP'] + address.to_bytes(2, byteorder='big') + length.to_bytes(2, byteorder='big'))
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: dump request returned: {status}')
+        return None
+
+    # the serial timeout applies per read call, long dumps take longer than that
+    data = bytearray()
+    while(len(data) < length):
+        chunk = ser.read(size=min(length - len(data), 1024))
+        if(len(chunk) == 0):
+            print(f'Error: dump stopped after {len(data)} of {length} bytes')
+            return None
+        data.extend(chunk)
+    return data
+
+def eeprom_crc(ser, address, length, comdefines):
+    ser.write(comdefines['BL_COM_CMD_EEPROMCRC'] + address.to_bytes(2, byteorder='big') + length.to_bytes(2, byteorder='big'))
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: eeprom crc request returned: {status}')
+        return None
+    return int.from_bytes(ser.read(size=4), byteorder='big')
+
+def read_eeprom(ser, address, length, comdefines):
+    ser.write(comdefines['BL_COM_CMD_EEPROMDUMP'] + address.to_bytes(2, byteorder='big') + length.to_bytes(2, byteorder='big'))
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: eeprom dump request returned: {status}')
+        return None
+    data = ser.read(size=length)
+    if(len(data) < length):
+        print(f'Error: eeprom dump stopped after {len(data)} of {length} bytes')
+        return None
+    return data
+
+def upload_eeprom(ser, image, comdefines, args):
+    print()
+    ranges = image_ranges(image)
+    if(len(ranges) > 0 and image_address_span(image)[1] >= comdefines['BL_COM_EEPROM_APPSIZE']):
+        print(f'Skipping eeprom upload, the file exceeds the {comdefines['BL_COM_EEPROM_APPSIZE']} bytes of the eeprom available to the application...')
+        return False
+
+    # ranges that already match aren't sent at all, the bootloader skips unchanged bytes in the others
+    changed = []
+    for (address, data) in ranges:
+        if(eeprom_crc(ser, address, len(data), comdefines) != zlib.crc32(data)):
+            changed.append((address, data))
+    frames = [build_frame(address + offset, data[offset:offset + comdefines['BL_COM_FRAME_MAXDATA']])
+        for (address, data) in changed for offset in range(0, len(data), comdefines['BL_COM_FRAME_MAXDATA'])]
+    print(f'Writing eeprom: {len(changed)} of {len(ranges)} ranges changed, {len(frames)} frames...')
+
+    for framenum, frame in enumerate(frames):
+        if(args.verbose):
+            print(f'Frame {framenum:3}: 0x{frame[0]:02X}{frame[1]:02X} | {frame[2]:2} -> ', end='')
+        # command and frame in one write, the bootloader reads the frame after its OK
+        ser.write(comdefines['BL_COM_CMD_EEPROMWRITE'] + frame)
+        status = int.from_bytes(ser.read(size=1))
+        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+            print(f'Error: eeprom write request returned: {status}')
+            return False
+        reply = int.from_bytes(ser.read(size=1))
+        if(not upload_error_handling(reply, framenum, 'Frame', comdefines, args)):
+            print('\t=> Eeprom upload failed!')
+            return False
+        if(args.verbose):
+            print('Upload OK')
+    print('\t=> Eeprom upload complete!')
+    return True
 
-                pagecounter += bytecount
+def verify_eeprom(ser, image, comdefines, args):
+    print()
+    print('Verifying eeprom...')
+    num_errors = 0
+    for (address, data) in image_ranges(image):
+        if(eeprom_crc(ser, address, len(data), comdefines) == zlib.crc32(data)):
+            continue
+        memory = read_eeprom(ser, address, len(data), comdefines)
+        if(memory is None):
+            num_errors += 1
+            continue
+        for offset in range(len(data)):
+            if(memory[offset] != data[offset]):
+                num_errors += 1
                 if(args.verbose):
-                    for byte in data_binary:
-                        print(colored(f'{byte:02X} ', 'red'), end='')
-                    print()
-                    print()
-        else:
-            print(f'Error: verify request returned: {status}')
-            break
+                    print(f'0x{address + offset:04X}: {memory[offset]:02X} should be {data[offset]:02X}')
 
-    if(args.verbose): 
-        print() 
     if(num_errors == 0):
         print('\t=> No errors detected!')
     else:
         print(f'\t=> Errors detected: {num_errors}')
+    return num_errors == 0
+
+def build_hex_records(ranges):
+    # 16 byte data records and the end of file record, addresses stay below 64K on this device
+    lines = []
+    for (address, data) in ranges:
+        for offset in range(0, len(data), 16):
+            chunk = data[offset:offset + 16]
+            record = bytearray([len(chunk), ((address + offset) >> 8) & 0xFF, (address + offset) & 0xFF, RT_DATARECORD])
+            record.extend(chunk)
+            record.append((256 - sum(record)) % 256)
+            lines.append(':' + record.hex().upper())
+    lines.append(':00000001FF')
+    return lines
+
+def write_hex_file(filename, ranges):
+    with open(filename, 'w') as fh:
+        for line in build_hex_records(ranges):
+            fh.write(line + '\n')
+
+def dump_program(ser, image, bootloader_start_address, filename, comdefines, args):
+    print()
+    # the ranges covered by the hex file, or the whole application section
+    if(image is not None):
+        ranges = [(address, len(data)) for (address, data) in image_ranges(image)]
+    else:
+        ranges = [(0, bootloader_start_address)]
+    print(f'Dumping {sum(length for (address, length) in ranges)} bytes in {len(ranges)} reads to {filename}...')
+
+    dumped = []
+    for (address, length) in ranges:
+        data = read_flash(ser, address, length, comdefines)
+        if(data is None):
+            print('\t=> Dump failed!')
+            return
+        dumped.append((address, data))
+
+    write_hex_file(filename, dumped)
+    print('\t=> Dump complete!')
 
-def upload_error_handling(reply, linenum, header:bool, comdefines, args):
+def upload_error_handling(reply, linenum, hbstr:str, comdefines, args):
     status = reply & comdefines['BL_COM_REPLY_STATUSMASK']
     info = reply & comdefines['BL_COM_UPLOADINFO_MASK']
-    hbstr = 'Header' if header else 'Body'
 
     if(status == comdefines['BL_COM_REPLY_OK']):
         if(args.verbose):
             print(f'{hbstr} OK, ', end='')
         return True
     elif(status == comdefines['BL_COM_REPLY_UPLOADERROR']):
+        stats['naks'] += 1
         if(args.verbose):
             if(info == comdefines['BL_COM_UPLOADERR_COLON']):
                 print(f'Line {linenum:3}: Upload info {hbstr}: Colon')
@@ -237,47 +414,472 @@ def upload_error_handling(reply, linenum, header:bool, comdefines, args):
                 print(f'Line {linenum:3}: Upload info {hbstr}: Line length')
             if(info == comdefines['BL_COM_UPLOADERR_CHECKSUM']):
                 print(f'Line {linenum:3}: Upload info {hbstr}: Checksum')
+            if(info == comdefines['BL_COM_UPLOADERR_ADDRESS']):
+                print(f'Line {linenum:3}: Upload info {hbstr}: Address outside of application section')
+        return False
+    elif(status == comdefines['BL_COM_REPLY_RXOVERRUN']):
+        print(f'Line {linenum:3} {hbstr}: The bootloader lost received bytes (RX buffer overrun), try --flow')
         return False
     else:
         print(f'Line {linenum:3} {hbstr}: Unknown status {status}')
         return False
 
-def upload_program(ser:Serial, hexfile: dict, comdefines, args):
+def upload_program(ser:Serial, image: dict, comdefines, args):
     print()
-    print(f'Starting upload: {len(hexfile['lines'])} lines...')
+    # the records are regenerated from the image, extended address records are not needed below 64K
+    lines = build_hex_records(image_ranges(image))
+    print(f'Starting upload: {len(lines)} lines...')
     num_errors = 0
 
     status = serial_send_code(ser, 'BL_COM_CMD_UPLOAD')
     if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
-        for linenum, line in enumerate(hexfile['lines']):
+        for linenum, line in enumerate(lines):
             if(args.verbose):
                 print(f'Line {linenum:3}: Line = {line.encode('ascii')} -> ', end='')
-            ser.write(line[:9].encode('ascii'))
-
-            header_reply = int.from_bytes(ser.read(size=1))
-            if(upload_error_handling(header_reply, linenum, True, comdefines, args)):
-                ser.write(line[9:].encode('ascii'))
+            # the bootloader decodes the record while it arrives and replies once after its last digit
+            ser.write(line.encode('ascii'))
 
-                body_reply = int.from_bytes(ser.read(size=1))
-                if(upload_error_handling(body_reply, linenum, False, comdefines, args)):
-                    if(args.verbose):
-                        print('Upload OK')
-                else:
-                    num_errors += 1
-                    break
+            reply = int.from_bytes(ser.read(size=1))
+            if(upload_error_handling(reply, linenum, 'Record', comdefines, args)):
+                if(args.verbose):
+                    print('Upload OK')
             else:
                 num_errors += 1
                 break
 
     else:
-        print(f'Line {linenum:3} Error: upload request returned {status}')
+        print(f'Error: upload request returned {status}')
+        num_errors += 1
 
     if(num_errors == 0):
-        mem_usage = float((hexfile['address_highest'] - hexfile['address_lowest'])) / float(hexfile['bootloader_start_address'])
-        print(f'\t=> Upload complete! Memory usage: {100*mem_usage:.1}%')
+        (address_lowest, address_highest) = image_address_span(image)
+        mem_usage = float((address_highest - address_lowest)) / float(image['bootloader_start_address'])
+        print(f'\t=> Upload complete! Memory usage: {100*mem_usage:.1f}%')
     else:
         print(f'\t=> Upload: {num_errors} errors occured!')
-    
+    return num_errors == 0
+
+def build_upload_frames(image, maxdata):
+    frames = [build_frame(address, data) for (address, data) in image_ranges(image, maxdata)]
+    frames.append(build_frame(0, b''))
+    return frames
+
+def read_page_crcs(ser:Serial, comdefines):
+    status = serial_send_code(ser, 'BL_COM_CMD_PAGECRCS')
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: page crc request returned {status}')
+        return None
+
+    num_pages = int.from_bytes(ser.read(size=1))
+    crc_data = ser.read(size=2 * num_pages)
+    pagesize = comdefines['BL_COM_PAGESIZE']
+    return {i * pagesize: int.from_bytes(crc_data[2*i:2*i + 2], byteorder='big') for i in range(num_pages)}
+
+def upload_program_changed_pages(ser:Serial, image: dict, comdefines, args):
+    print()
+    pages = image_pages(image)
+    device_crcs = read_page_crcs(ser, comdefines)
+    if(device_crcs is None):
+        return False
+
+    changed = {address: page for (address, page) in pages.items() if device_crcs.get(address) != binascii.crc_hqx(page, 0)}
+    print(f'{len(changed)} of {len(pages)} pages changed')
+    if(len(changed) > 0):
+        return upload_program_pages(ser, image, comdefines, args, changed)
+    return True
+
+def image_descriptor_crc(image):
+    # crc of the application section from 0 to the end of the image, bytes not set by the hex file count as erased (0xFF)
+    # like in the pages of the page upload, so unverified flash content is never part of the descriptor
+    flash = bytearray(b'\xFF' * (image_address_span(image)[1] + 1))
+    for (address, data) in image_ranges(image):
+        flash[address:address + len(data)] = data
+    return zlib.crc32(flash)
+
+def image_has_gaps(image):
+    ranges = image_ranges(image)
+    return len(ranges) != 1 or ranges[0][0] != 0
+
+def mark_application_valid(ser:Serial, image, comdefines, args):
+    # image descriptor: the application section from 0 to the end of the image, checked by the bootloader at startup
+    length = image_address_span(image)[1] + 1
+    crc = image_descriptor_crc(image)
+
+    # lets the bootloader start the application right away after a power-on reset
+    descriptor = length.to_bytes(2, byteorder='big') + crc.to_bytes(4, byteorder='big') + args.app_version.to_bytes(2, byteorder='big')
+    ser.write(comdefines['BL_COM_CMD_APPVALID'] + descriptor)
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
+        status = int.from_bytes(ser.read(size=1))
+    if(status == comdefines['BL_COM_REPLY_UPLOADERROR'] | comdefines['BL_COM_UPLOADERR_CHECKSUM'] and image_has_gaps(image)):
+        # the gaps still hold what was in the flash before, the application only starts after the entry window
+        print('Error: application not marked as valid, the gaps between the ranges of the image are not erased (--replace erases them)')
+        return False
+    if(status != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: application valid request returned {status}')
+        return False
+    print(f'Application marked as valid: {length} bytes, crc 0x{crc:08X}, version {args.app_version}')
+    return True
+
+def erase_application(ser:Serial, comdefines):
+    print()
+    print('Erasing application section...')
+    status = serial_send_code(ser, 'BL_COM_CMD_ERASE')
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
+        status = int.from_bytes(ser.read(size=1))
+    if(status != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: erase request returned {status}')
+        return False
+    print('\t=> Erase complete!')
+    return True
+
+def set_upload_mode(ser:Serial, flags, comdefines):
+    ser.write(comdefines['BL_COM_CMD_UPLOADMODE'] + flags.to_bytes(1))
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: upload mode request returned {status}')
+        return False
+    return True
+
+def compress_page(page, comdefines):
+    # greedy LZ77 within the page, see bootloader-communication.h for the token format
+    minmatch = comdefines['BL_COM_LZ_MINMATCH']
+    maxmatch = comdefines['BL_COM_LZ_MAXMATCH']
+    maxliterals = comdefines['BL_COM_LZ_MAXLITERALS']
+    out = bytearray()
+    literals = bytearray()
+
+    def flush_literals():
+        for offset in range(0, len(literals), maxliterals):
+            chunk = literals[offset:offset + maxliterals]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+        literals.clear()
+
+    pos = 0
+    while(pos < len(page)):
+        best_len = 0
+        best_distance = 0
+        for distance in range(1, pos + 1):
+            length = 0
+            while(pos + length < len(page) and length < maxmatch and page[pos + length - distance] == page[pos + length]):
+                length += 1
+            if(length > best_len):
+                best_len = length
+                best_distance = distance
+
+        # a match costs two bytes, shorter ones are cheaper as literals
+        if(best_len > minmatch):
+            flush_literals()
+            out.append(0x80 | (best_len - minmatch))
+            out.append(best_distance - 1)
+            pos += best_len
+        else:
+            literals.append(page[pos])
+            pos += 1
+    flush_literals()
+    return out
+
+def upload_program_pages(ser:Serial, image: dict, comdefines, args, pages=None, compressed=False):
+    print()
+    if(pages is None):
+        pages = image_pages(image)
+    if(args.replace):
+        # the application section was erased, erased pages don't have to be written again
+        pages = {address: page for (address, page) in pages.items() if page != b'\xFF' * len(page)}
+    print(f'Starting {"compressed " if compressed else ""}page upload: {len(pages)} pages...')
+    num_errors = 0
+    bytes_sent = 0
+
+    for pagenum, (page_address, page) in enumerate(pages.items()):
+        if(args.verbose):
+            print(f'Page {pagenum:3}: 0x{page_address:04X} -> ', end='')
+        # command code and page frame are sent at once, the bootloader replies twice
+        if(compressed):
+            frame = comdefines['BL_COM_CMD_PAGEWRITECOMPRESSED'] + build_frame(page_address, compress_page(page, comdefines))
+        else:
+            frame = comdefines['BL_COM_CMD_PAGEWRITE'] + build_frame(page_address, page, False)
+        ser.write(frame)
+        bytes_sent += len(frame)
+
+        status = int.from_bytes(ser.read(size=1))
+        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+            upload_error_handling(status, pagenum, 'Page', comdefines, args)
+            num_errors += 1
+            break
+
+        reply = int.from_bytes(ser.read(size=1))
+        if(upload_error_handling(reply, pagenum, 'Page', comdefines, args)):
+            if(args.verbose):
+                print('Upload OK')
+        else:
+            num_errors += 1
+            break
+
+    if(num_errors == 0):
+        print(f'\t=> Upload complete! ({bytes_sent} bytes sent for {len(pages) * comdefines["BL_COM_PAGESIZE"]} bytes of pages)')
+    else:
+        print(f'\t=> Upload: {num_errors} errors occured!')
+    return num_errors == 0
+
+def build_frame(address, data, with_length=True, seq=None):
+    frame = bytearray() if seq is None else bytearray([seq])
+    frame.extend([(address >> 8) & 0xFF, address & 0xFF])
+    if(with_length):
+        frame.append(len(data))
+    frame.extend(data)
+    crc = binascii.crc_hqx(frame, 0)
+    frame.extend(crc.to_bytes(2, byteorder='big'))
+    return frame
+
+def upload_program_binary(ser:Serial, image: dict, comdefines, args):
+    print()
+    frames = build_upload_frames(image, comdefines['BL_COM_FRAME_MAXDATA'])
+    print(f'Starting binary upload: {len(frames)} frames...')
+    num_errors = 0
+
+    status = serial_send_code(ser, 'BL_COM_CMD_UPLOADBINARY')
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
+        for framenum, frame in enumerate(frames):
+            if(args.verbose):
+                print(f'Frame {framenum:3}: 0x{frame[0]:02X}{frame[1]:02X} | {frame[2]:2} -> ', end='')
+            ser.write(frame)
+
+            reply = int.from_bytes(ser.read(size=1))
+            if(upload_error_handling(reply, framenum, 'Frame', comdefines, args)):
+                if(args.verbose):
+                    print('Upload OK')
+            else:
+                num_errors += 1
+                break
+    else:
+        print(f'Error: upload request returned {status}')
+        num_errors += 1
+
+    if(num_errors == 0):
+        print('\t=> Upload complete!')
+    else:
+        print(f'\t=> Upload: {num_errors} errors occured!')
+    return num_errors == 0
+
+WINDOW_FRAME_DATA = 32
+WINDOW_REPLY_TIMEOUT = 0.5
+WINDOW_MAX_RETRIES = 10
+
+def upload_program_windowed(ser:Serial, image: dict, comdefines, args):
+    print()
+    chunks = image_ranges(image, WINDOW_FRAME_DATA)
+    chunks.append((0, b''))
+    frames = [build_frame(address, data, True, i & 0xFF) for i, (address, data) in enumerate(chunks)]
+    print(f'Starting windowed upload: {len(frames)} frames...')
+
+    status = serial_send_code(ser, 'BL_COM_CMD_UPLOADWINDOWED')
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: upload request returned {status}')
+        return False
+    # credit: the bootloader sends the limit of bytes_sent (mod 256) with every reply instead of a fixed window
+    credit = args.flow == 'credit'
+    window_bytes = int.from_bytes(ser.read(size=1))
+    if(window_bytes == 0):
+        print(f'Error: windowed upload refused with {int.from_bytes(ser.read(size=1))} (upload mode set)')
+        return False
+    credit_limit = window_bytes
+    bytes_sent = 0
+    reply_len = 3 if credit else 2
+    if(args.verbose):
+        print(f'Bootloader accepts {window_bytes} bytes in flight')
+
+    statusmask = comdefines['BL_COM_REPLY_STATUSMASK']
+    infomask = comdefines['BL_COM_UPLOADINFO_MASK']
+    resync_errors = [comdefines['BL_COM_UPLOADERR_LINELEN'], comdefines['BL_COM_UPLOADERR_TIMEOUT']]
+
+    # the end frame is only sent once every data frame is acknowledged
+    last = len(frames) - 1
+    in_flight = {} # seq -> frame index
+    to_send = list(range(last))
+    sent = [0] * len(frames)
+    retries = 0
+    finished = False
+    error = None
+
+    def may_send(frame, bytes_in_flight):
+        if(credit):
+            return len(frame) <= (credit_limit - bytes_sent) & 0xFF
+        return len(in_flight) == 0 or bytes_in_flight + len(frame) <= window_bytes
+
+    timeout = ser.timeout
+    ser.timeout = WINDOW_REPLY_TIMEOUT
+    try:
+        while not finished and error is None:
+            if(len(to_send) == 0 and len(in_flight) == 0):
+                to_send.append(last)
+
+            bytes_in_flight = sum(len(frames[i]) for i in in_flight.values())
+            while(error is None and len(to_send) > 0 and may_send(frames[to_send[0]], bytes_in_flight)):
+                index = to_send.pop(0)
+                sent[index] += 1
+                if(sent[index] > WINDOW_MAX_RETRIES):
+                    error = f'frame {index}: too many retries'
+                    break
+                ser.write(frames[index])
+                in_flight[index & 0xFF] = index
+                bytes_in_flight += len(frames[index])
+                bytes_sent += len(frames[index])
+
+            if(error is not None):
+                break
+
+            reply = ser.read(size=reply_len)
+            if(len(reply) < reply_len):
+                # stalled link: everything in flight is considered lost, the bootloader consumed it by now
+                retries += 1
+                stats['retries'] += len(in_flight)
+                credit_limit = (bytes_sent + window_bytes) & 0xFF
+                if(args.verbose):
+                    print(f'Timeout, resending {len(in_flight)} frames')
+                to_send = sorted(in_flight.values()) + to_send
+                in_flight.clear()
+            else:
+                status, seq = reply[0], reply[1]
+                if(credit):
+                    credit_limit = reply[2]
+                index = in_flight.pop(seq, None)
+                if(status & statusmask == comdefines['BL_COM_REPLY_OK']):
+                    if(index == last):
+                        finished = True
+                    if(args.verbose and index is not None):
+                        print(f'Frame {index:3}: OK')
+                elif(status & statusmask == comdefines['BL_COM_REPLY_UPLOADERROR']):
+                    retries += 1
+                    stats['naks'] += 1
+                    info = status & infomask
+                    if(info in resync_errors):
+                        # the bootloader dropped all pending input
+                        if(index is not None):
+                            to_send.insert(0, index)
+                        stats['retries'] += len(in_flight) + (index is not None)
+                        to_send = sorted(in_flight.values()) + to_send
+                        in_flight.clear()
+                    elif(info == comdefines['BL_COM_UPLOADERR_CHECKSUM']):
+                        if(index is not None):
+                            to_send.insert(0, index)
+                            stats['retries'] += 1
+                    else:
+                        error = f'frame {index}: upload error {info}'
+                    if(args.verbose):
+                        print(f'Frame {index}: NAK {info}, resending')
+                else:
+                    error = f'unknown status {status}'
+    finally:
+        ser.timeout = timeout
+
+    if(error is None):
+        print(f'\t=> Upload complete! ({retries} retransmissions)')
+    else:
+        print(f'\t=> Upload failed: {error}')
+    return error is None
+
+SYNC_REPLY_TIMEOUT = 0.02
+SYNC_ATTEMPTS = 7
+SYNC_FILL_ATTEMPT = 3
+
+def sync_bootloader(ser:Serial, comdefines, args):
+    # works right after a reset (the bootloader may still be starting) and in the command loop:
+    # stale input is flushed, everything before OK + nonce is discarded, each retry waits twice as long
+    timeout = ser.timeout
+    reply_timeout = SYNC_REPLY_TIMEOUT
+    try:
+        for attempt in range(SYNC_ATTEMPTS):
+            if(attempt == SYNC_FILL_ATTEMPT):
+                # no reply for a while: the bootloader may still be inside a frame of an aborted session
+                ser.write(comdefines['BL_COM_SYNC_FILL'].to_bytes(1) * comdefines['BL_COM_SYNC_FILLLEN'])
+            ser.reset_input_buffer()
+            nonce = bytes(0x80 | byte for byte in os.urandom(comdefines['BL_COM_SYNC_NONCELEN']))
+            expected = comdefines['BL_COM_REPLY_OK'].to_bytes(1) + nonce
+            ser.write(comdefines['BL_COM_CMD_SYNC'] + nonce)
+
+            received = bytearray()
+            deadline = time.monotonic() + reply_timeout
+            while(not received.endswith(expected) and time.monotonic() < deadline):
+                ser.timeout = deadline - time.monotonic()
+                received.extend(ser.read(size=1))
+            if(received.endswith(expected)):
+                if(args.verbose):
+                    print(f'Bootloader in sync after {attempt + 1} attempts ({len(received) - len(expected)} stale bytes)')
+                return True
+            reply_timeout *= 2
+    finally:
+        ser.timeout = timeout
+    print('Error: no sync reply from the bootloader')
+    return False
+
+def drain_input(ser:Serial, idle=0.05):
+    '''drops whatever the bootloader still sends, returns once the line was idle for idle seconds'''
+    timeout = ser.timeout
+    ser.timeout = idle
+    while(ser.read(size=64)):
+        pass
+    ser.timeout = timeout
+    ser.reset_input_buffer()
+
+def switch_baudrate(ser:Serial, max_baudrate, comdefines, args):
+    rates = [comdefines[f'BL_COM_BAUD_{i}'] for i in range(comdefines['BL_COM_BAUD_COUNT'])]
+    start_rate = ser.baudrate
+    confirm_timeout = comdefines['BL_COM_BAUD_CONFIRMTIMEOUT_MS'] / 1000
+
+    # try the fastest rate first, fall back to the next slower one
+    candidates = sorted([i for (i, rate) in enumerate(rates) if start_rate < rate <= max_baudrate], key=lambda i: rates[i], reverse=True)
+    for index in candidates:
+        ser.write(comdefines['BL_COM_CMD_SETBAUD'] + index.to_bytes(1))
+        status = int.from_bytes(ser.read(size=1))
+        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_UNKNOWNCMD']):
+            drain_input(ser)
+            print('Bootloader does not support switching the baudrate')
+            return start_rate
+        reply = ser.read(size=1)
+        if(reply == bytes([comdefines['BL_COM_REPLY_OK']])):
+            ser.baudrate = rates[index]
+            ser.write(comdefines['BL_COM_CMD_SETBAUD'])
+            timeout = ser.timeout
+            ser.timeout = confirm_timeout / 2
+            confirm = ser.read(size=1)
+            ser.timeout = timeout
+            if(len(confirm) == 1 and confirm[0] == comdefines['BL_COM_REPLY_OK']):
+                print(f'Switched to {rates[index]} baud')
+                return rates[index]
+            if(args.verbose):
+                print(f'{rates[index]} baud does not work, rolling back')
+        else:
+            # a lost or garbled reply may still have been an OK, so the bootloader could be at the new rate
+            print(f'Error: baudrate switch to {rates[index]} returned {reply.hex() or "nothing"}')
+
+        # the bootloader rolls back on its own once the confirmation times out
+        ser.baudrate = start_rate
+        with timed_phase('baudrate-rollback'):
+            time.sleep(2 * confirm_timeout)
+        ser.reset_input_buffer()
+
+    return start_rate
+
+FLOW_MODES = ['none', 'xonxoff', 'rtscts', 'credit']
+
+def set_flow_control(ser:Serial, flow, comdefines):
+    ser.write(comdefines['BL_COM_CMD_FLOWCONTROL'] + comdefines[f'BL_COM_FLOW_{flow.upper()}'].to_bytes(1))
+    status = int.from_bytes(ser.read(size=1))
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_UNKNOWNCMD']):
+        drain_input(ser)
+        print('Bootloader does not support flow control')
+        return 'none'
+    reply = int.from_bytes(ser.read(size=1))
+    if(reply != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: flow control {flow} returned {reply}')
+        return 'none'
+
+    # xonxoff: the tty driver pauses on XOFF and drops 0x11 / 0x13 from the input
+    ser.xonxoff = flow == 'xonxoff'
+    ser.rtscts = flow == 'rtscts'
+    print(f'Flow control: {flow}')
+    return flow
 
 def extract_com_constants(filename):
     with open(filename, 'r') as fh:
@@ -300,119 +902,531 @@ def extract_com_constants(filename):
         return matches
     return {}
 
-def check_checksum(line_without_colon, linenum):
-    line = line_without_colon
-    result = 0
-    checksum = int(line[len(line)-2:], 16)
-    to_check = line[:len(line) - 2]
+def image_store(image, address, data):
+    # copy a record into the sparse page image, records may cross page boundaries
+    pagesize = image['pagesize']
+    pages = image['pages']
+    offset = 0
+    while(offset < len(data)):
+        (page_index, page_offset) = divmod(address + offset, pagesize)
+        count = min(pagesize - page_offset, len(data) - offset)
+        if page_index not in pages:
+            pages[page_index] = (bytearray(b'\xFF' * pagesize), bytearray(pagesize))
+        (page, mask) = pages[page_index]
+        page[page_offset:page_offset + count] = data[offset:offset + count]
+        mask[page_offset:page_offset + count] = b'\x01' * count
+        offset += count
+
+def parse_hex_image(content: bytes, pagesize, verbose):
+    # sparse memory image: page index -> (page buffer, mask of the bytes set by the hex file)
+    image = {}
+    image['pagesize'] = pagesize
+    image['pages'] = {}
+    image['num_records'] = 0
+    image['num_checksum_errors'] = 0
+    image['num_unknown_records'] = 0
+    image['start_address'] = None
+
+    base_address = 0
+    end_reached = False
+    for linenum, line in enumerate(content.splitlines(), start=1):
+        line = line.strip()
+        if(len(line) == 0):
+            continue
+        if not line.startswith(b':'):
+            print(f'Line {linenum:4}: Invalid line: {line.decode('ascii', 'replace')}')
+            continue
+        try:
+            record = bytes.fromhex(line[1:].decode('ascii'))
+        except ValueError:
+            print(f'Line {linenum:4}: Invalid hex characters: {line.decode('ascii', 'replace')}')
+            continue
+        if(len(record) < 5 or len(record) != record[0] + 5):
+            print(f'Line {linenum:4}: Invalid record length: {line.decode('ascii')}')
+            continue
+
+        image['num_records'] += 1
+        # the checksum byte makes the sum of all record bytes zero
+        if(sum(record) & 0xFF != 0):
+            print(f'Line {linenum:4}: Record Checksum Error: {line.decode('ascii')}')
+            image['num_checksum_errors'] += 1
+            continue
+
+        rtype = record[3]
+        data = memoryview(record)[4:-1]
+        if rtype == RT_DATARECORD:
+            if not end_reached:
+                image_store(image, base_address + ((record[1] << 8) | record[2]), data)
+        elif rtype == RT_EOF:
+            if(verbose):
+                print(f'Line {linenum:4}: End of file reached')
+            end_reached = True
+        elif rtype == RT_EXTSEGMENTADDRESSRECORD:
+            base_address = int.from_bytes(data, byteorder='big') << 4
+            if(verbose):
+                print(f'Line {linenum:4}: Extended Segment Address Record: base={hex(base_address)}')
+        elif rtype == RT_EXTLINEARADDRESSRECORD:
+            base_address = int.from_bytes(data, byteorder='big') << 16
+            if(verbose):
+                print(f'Line {linenum:4}: Extended Linear Address Record: base={hex(base_address)}')
+        elif rtype == RT_STARTSEGMENTADDRESSRECORD or rtype == RT_STARTLINEARADDRESSRECORD:
+            # the bootloader always starts the application at 0x0000, the start address is informational
+            image['start_address'] = int.from_bytes(data, byteorder='big')
+            if(verbose):
+                print(f'Line {linenum:4}: Start Address Record: {hex(image['start_address'])}')
+        else:
+            print(f'Line {linenum:4}: Unknown record type {rtype:02X}!')
+            image['num_unknown_records'] += 1
+
+    image['pages'] = dict(sorted(image['pages'].items()))
+    return image
+
+def read_hex_image(filename, pagesize, verbose, use_cache=True):
+    with open(filename, 'rb') as fh:
+        content = fh.read()
+
+    # the same artifact is usually flashed more than once, the parsed image is cached by content hash
+    digest = hashlib.sha256(content).hexdigest()
+    cache_filename = os.path.join(IMAGE_CACHE_DIR, f'{digest}-{pagesize}-v{IMAGE_CACHE_VERSION}.pickle')
+    if(use_cache):
+        try:
+            with open(cache_filename, 'rb') as fh:
+                image = pickle.load(fh)
+            print(f'{len(image['pages'])} pages (cached)')
+            return image
+        except (OSError, pickle.UnpicklingError, EOFError):
+            pass
+
+    image = parse_hex_image(content, pagesize, verbose)
+    print(f'{image['num_records']} records, {len(image['pages'])} pages')
+
+    if(use_cache and image['num_checksum_errors'] == 0):
+        try:
+            os.makedirs(IMAGE_CACHE_DIR, exist_ok=True)
+            with open(cache_filename, 'wb') as fh:
+                pickle.dump(image, fh)
+        except OSError as e:
+            if(verbose):
+                print(f'Could not write hex cache {cache_filename}: {e}')
+    return image
+
+def image_ranges(image, maxlen=None):
+    # contiguous runs of bytes set by the hex file, optionally split into chunks of at most maxlen bytes
+    pagesize = image['pagesize']
+    ranges = []
+    for (page_index, (page, mask)) in image['pages'].items():
+        start = mask.find(1)
+        while(start != -1):
+            end = mask.find(0, start)
+            if(end == -1):
+                end = pagesize
+            address = page_index * pagesize + start
+            if(len(ranges) > 0 and ranges[-1][0] + len(ranges[-1][1]) == address):
+                ranges[-1][1].extend(page[start:end])
+            else:
+                ranges.append((address, bytearray(page[start:end])))
+            start = mask.find(1, end)
+
+    if(maxlen is None):
+        return ranges
+    return [(address + offset, data[offset:offset + maxlen]) for (address, data) in ranges for offset in range(0, len(data), maxlen)]
+
+def image_pages(image):
+    # complete pages by start address, bytes not covered by the hex file stay erased (0xFF)
+    pagesize = image['pagesize']
+    return {page_index * pagesize: bytes(page) for (page_index, (page, mask)) in image['pages'].items()}
+
+def image_address_span(image):
+    ranges = image_ranges(image)
+    if(len(ranges) == 0):
+        return (0, 0)
+    return (ranges[0][0], ranges[-1][0] + len(ranges[-1][1]) - 1)
+
+
+class StatsSerial:
+    '''Serial wrapper for --stats: counts the bytes and times every round trip (first write after a read until the reply arrives)'''
+    def __init__(self, ser):
+        self.ser = ser
+        self.bytes_written = 0
+        self.bytes_read = 0
+        self.write_time = None
+        self.round_trips = []
+        self.timeouts = 0
+
+    def write(self, data):
+        if(self.write_time is None):
+            self.write_time = time.monotonic()
+        self.bytes_written += len(data)
+        return self.ser.write(data)
+
+    def read(self, size=1):
+        data = self.ser.read(size)
+        self.bytes_read += len(data)
+        if(self.write_time is not None):
+            if(len(data) > 0):
+                self.round_trips.append(time.monotonic() - self.write_time)
+            else:
+                self.timeouts += 1
+            self.write_time = None
+        return data
 
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
 
-    for i in range(int(len(to_check) / 2)):
-        byte = int(line[i*2 : i*2 + 2], 16)
-        result += byte
-    
-    calculated_checksum = (256 - result) % 256
-    #print(f'Checksum calc on line {linenum}: Calculated: {hex(result)} => (inverse + 1) => {hex(calculated_checksum)} checksum: {hex(checksum)}')
+    def __setattr__(self, name, value):
+        if(name in ['ser', 'bytes_written', 'bytes_read', 'write_time', 'round_trips', 'timeouts']):
+            object.__setattr__(self, name, value)
+        else:
+            setattr(self.ser, name, value)
+
+@contextlib.contextmanager
+def timed_phase(name):
+    # phases that run more than once (parse) add up, a phase inside another one only counts for the inner one,
+    # so the phases add up to the session time
+    start = time.monotonic()
+    stats.nested.append(0)
+    try:
+        yield
+    finally:
+        seconds = time.monotonic() - start
+        stats['phases'][name] = stats['phases'].get(name, 0) + seconds - stats.nested.pop()
+        if(len(stats.nested) > 0):
+            stats.nested[-1] += seconds
+
+def round_trip_stats(round_trips, timeouts):
+    histogram = {}
+    lower = 0
+    for upper in RTT_BUCKETS_MS + [None]:
+        label = f'{lower}-{upper}' if upper is not None else f'{lower}-'
+        histogram[label] = sum(1 for rtt in round_trips if lower <= rtt * 1000 and (upper is None or rtt * 1000 < upper))
+        lower = upper
+    result = {'count': len(round_trips), 'timeouts': timeouts, 'histogram_ms': histogram}
+    if(len(round_trips) > 0):
+        result.update({'min_ms': 1000 * min(round_trips), 'mean_ms': 1000 * sum(round_trips) / len(round_trips), 'max_ms': 1000 * max(round_trips)})
+    return result
+
+def write_stats(filename, report):
+    if(filename == '-'):
+        print()
+        print('Statistics:')
+        print(json.dumps(report, indent=2))
+    else:
+        with open(filename, 'w') as fh:
+            json.dump(report, fh, indent=2)
+            fh.write('\n')
+        print(f'Statistics written to {filename}')
+
+# upload mode -> features (BL_COM_FEATURE_*) the bootloader needs for it
+MODE_FEATURES = {
+    'hex': ['UPLOAD_HEX'],
+    'binary': ['UPLOAD_BINARY'],
+    'window': ['UPLOAD_WINDOWED'],
+    'page': ['PAGE_WRITE'],
+    'compressed': ['PAGE_WRITE_COMPRESSED'],
+    'diff': ['PAGE_CRCS', 'PAGE_WRITE'],
+}
+
+def has_features(features, names, comdefines):
+    return all(features & comdefines[f'BL_COM_FEATURE_{name}'] for name in names)
+
+def feature_names(features, comdefines):
+    return [name[len('BL_COM_FEATURE_'):].lower() for (name, bit) in comdefines.items() if name.startswith('BL_COM_FEATURE_') and features & bit]
+
+def read_info(ser, comdefines, args):
+    # returns (version, bootloader section start, feature mask), (None, None, None) if the bootloader doesn't answer
+    status = serial_send_code(ser, 'BL_COM_CMD_INFO')
+    if(status & comdefines['BL_COM_REPLY_STATUSMASK'] != comdefines['BL_COM_REPLY_OK']):
+        print(f'Error: information request returned: {status}')
+        return (None, None, None)
+
+    bl_version_len = int.from_bytes(ser.read())
+    bl_version = ser.read(size=bl_version_len).decode('ascii')
+    bl_section_start_len = int.from_bytes(ser.read())
+    bl_section_start = int.from_bytes(ser.read(size=bl_section_start_len), byteorder='little')
+    bl_features_len = int.from_bytes(ser.read())
+    bl_features = int.from_bytes(ser.read(size=bl_features_len), byteorder='little')
+
+    if(args.info):
+        print('Bootloader Information:')
+        print(f'\tVersion: {bl_version}')
+        print(f'\tTool Version: {TOOL_VERSION}')
+        print(f'\tBootloader Section Start Address: 0x{bl_section_start:X}')
+        print(f'\tFeatures: 0x{bl_features:04X} ({", ".join(feature_names(bl_features, comdefines))})')
+    return (bl_version, bl_section_start, bl_features)
+
+def flash_device(port, args, comdefines, image, eeprom_image, parse_seconds=0):
+    '''
+    One bootloader session on one port: info, baudrate, flow control, fuses, dump, upload, verify, eeprom and quit.
+    The parsed images are shared between the devices of --ports and only read. Returns the result of the session,
+    'ok' is False if any step failed.
+    '''
+    # switch_baudrate / set_flow_control change the per device settings
+    args = argparse.Namespace(**vars(args))
+    result = {'port': port, 'ok': False, 'upload': None, 'verify': None, 'eeprom': None, 'error': None, 'stats': None, 'phases': stats['phases']}
+    print(f'Trying to connect to bootloader on serial port {port} with BR {args.baudrate}...')
+
+    # the hex files were parsed once before the sessions, every device counts that time
+    stats['phases']['parse'] = parse_seconds
+    session_start = time.monotonic() - parse_seconds
+    ser = None
+    try:
+        with timed_phase('connect'):
+            ser = StatsSerial(Serial(port, args.baudrate, timeout=5))
+            synced = sync_bootloader(ser, comdefines, args)
+        if(not synced):
+            result['error'] = 'no reply from the bootloader'
+            return result
 
-    return calculated_checksum == checksum
+        # request misc information from bootloader
+        with timed_phase('info'):
+            (bl_version, bl_section_start, bl_features) = read_info(ser, comdefines, args)
+        if(bl_version is None):
+            result['error'] = 'no reply from the bootloader'
+            return result
+
+        # smaller builds of the bootloader leave commands out (bootloader-config.h)
+        def supported(*names):
+            return has_features(bl_features, names, comdefines)
+
+        if(args.max_baudrate > args.baudrate):
+            if(supported('SETBAUD')):
+                with timed_phase('baudrate'):
+                    switch_baudrate(ser, args.max_baudrate, comdefines, args)
+            elif(args.verbose):
+                print('Bootloader does not support switching the baudrate')
+
+        if(args.flow != 'none'):
+            if(args.flow == 'xonxoff' and (args.mode != 'hex' or not args.no_verify or args.dump or args.fuses)):
+                print('Warning: with xonxoff binary replies (crcs, dump, fuses) lose their 0x11 / 0x13 bytes')
+            if(supported('FLOWCONTROL')):
+                with timed_phase('flowcontrol'):
+                    args.flow = set_flow_control(ser, args.flow, comdefines)
+            else:
+                print('Bootloader does not support flow control')
+                args.flow = 'none'
 
+        if(not supported(*MODE_FEATURES[args.mode])):
+            if(not supported(*MODE_FEATURES['page'])):
+                print(f'Error: bootloader has neither the {args.mode} nor the page upload')
+                result['error'] = 'upload not supported'
+                return result
+            print(f'Bootloader does not support the {args.mode} upload, using page')
+            args.mode = 'page'
 
-def read_hex_file(filename, bootloader_start_address, verbose):
-    hexfile = {}
-    hexfile['data'] = []
-    hexfile['lines'] = []
-    hexfile['num_unknown_records'] = 0
-    hexfile['bootloader_start_address'] = bootloader_start_address
-    hexfile['bootloader_section_intersect'] = False
-    hexfile['address_lowest'] = None
-    hexfile['address_highest'] = None
+        # read fuses
+        if(args.fuses):
+            if(supported('FUSES')):
+                with timed_phase('fuses'):
+                    read_fuses(ser, comdefines, args)
+            else:
+                print('Bootloader does not support reading the fuses')
 
-    with open(filename, 'r') as fh:
-        lines = fh.readlines()
-        print(f'{len(lines)} lines')
-        hexfile['lines'] = [line.strip() for line in lines]
-
-        linenum = 0
-        end_reached = False
-        for line in lines:
-            linenum += 1
-            if not line.startswith(':'):
-                print(f'Invalid line: {line}')
-            line = line[1:].strip()
-
-            bytecount = int(line[0:2], 16)
-            rtype = line[6:8]
-
-            if rtype == RT_DATARECORD:
-                address = int(line[2:6], 16)
-                if(address >= bootloader_start_address):
-                    if not hexfile['bootloader_section_intersect']:
-                        print(f'Warning: hex file contents intersect with bootloader')
-                    hexfile['bootloader_section_intersect'] = True
-
-                if(hexfile['address_lowest'] is None):
-                    hexfile['address_lowest'] = address
-                elif(address < hexfile['address_lowest']):
-                    hexfile['address_lowest'] = address
-
-                if(hexfile['address_highest'] is None):
-                    hexfile['address_highest'] = address
-                elif(address > hexfile['address_highest']):
-                    hexfile['address_highest'] = address
-
-                data = []
-                data_binary = bytearray()
-                for i in range(bytecount):
-                    byte_str = line[(8+i*2):(10+i*2)]
-                    data.append(int(byte_str, 16))
-                    data_binary.extend(bytearray.fromhex(byte_str))
-
-                checksum_ok = check_checksum(line, linenum)
-
-                if not checksum_ok:
-                    print(f'Line {linenum:4}: Data Record Checksum Error: {line}')
-                if not end_reached:
-                    hexfile['data'].append((bytecount, address, data, checksum_ok, data_binary))
-            elif rtype == RT_EOF:
-                if(verbose):
-                    print(f'Line {linenum:4}: End of file reached')
-                end_reached = True
-            elif rtype == RT_STARTSEGMENTADDRESSRECORD:
-                segment = int(line[8:12], 16)
-                offset = int(line[12:16], 16)
-
-                if(verbose):
-                    print(f'Line {linenum:4}: Start Segment Address Record: segment={hex(segment)}, offset={hex(offset)}', end='')
-
-                checksum_ok = check_checksum(line, linenum)
-                if(verbose):
-                    if checksum_ok:
-                        print('(OK)')
+        # hex file: upload and / or verify
+        verify = not args.no_verify
+        upload = not args.no_upload
+        upload_stats = None
+        if(image is not None):
+            image = dict(image, bootloader_start_address=bl_section_start)
+
+        # back up the flash content before it is overwritten
+        if(args.dump and not supported('DUMP')):
+            print('Error: bootloader does not support reading the flash, no dump')
+            result['error'] = 'dump not supported'
+            return result
+        if(args.dump):
+            with timed_phase('dump'):
+                dump_program(ser, image, bl_section_start, args.dump if port == args.port else f'{args.dump}.{os.path.basename(port)}', comdefines, args)
+
+        if(image is not None and (verify or upload)):
+            if(upload):
+                # records are sent in ascending order except for windowed retransmits, which need the read-back
+                replace_records = args.replace and args.mode in ['hex', 'binary']
+                bytes_written = ser.bytes_written
+                upload_start = time.monotonic()
+                result['upload'] = False
+                with timed_phase('upload'):
+                    if(image['num_checksum_errors'] > 0 or image['num_unknown_records'] > 0):
+                        print('Skipping upload, hex file contains invalid records...')
+                    elif(bl_section_start is not None and image_address_span(image)[1] >= bl_section_start):
+                        print('Warning: hex file contents intersect with bootloader')
+                        print('Skipping upload to preserve bootloader...')
+                    elif(args.replace and not supported('ERASE')):
+                        print('Skipping upload, the bootloader does not support erasing...')
+                    elif(args.replace and not erase_application(ser, comdefines)):
+                        print('Skipping upload, erase failed...')
+                    elif(replace_records and not supported('UPLOAD_MODE')):
+                        print('Skipping upload, replace mode not available...')
+                    elif(replace_records and not set_upload_mode(ser, comdefines['BL_COM_UPLOADMODE_REPLACE'], comdefines)):
+                        print('Skipping upload, replace mode not available...')
+                    elif(args.mode == 'hex'):
+                        result['upload'] = upload_program(ser, image, comdefines, args)
+                    elif(args.mode == 'binary'):
+                        result['upload'] = upload_program_binary(ser, image, comdefines, args)
+                    elif(args.mode == 'window'):
+                        result['upload'] = upload_program_windowed(ser, image, comdefines, args)
+                    elif(args.mode == 'compressed'):
+                        result['upload'] = upload_program_pages(ser, image, comdefines, args, compressed=True)
+                    elif(args.mode == 'diff'):
+                        result['upload'] = upload_program_changed_pages(ser, image, comdefines, args)
                     else:
-                        print('(CS ERROR)')
+                        result['upload'] = upload_program_pages(ser, image, comdefines, args)
+
+                    if(replace_records):
+                        set_upload_mode(ser, 0, comdefines)
+
+                # payload: the data of the hex file, also for the modes that send less (compressed, diff)
+                upload_seconds = time.monotonic() - upload_start
+                payload_bytes = sum(len(data) for (address, data) in image_ranges(image))
+                line_bytes_per_second = ser.baudrate / 10
+                upload_stats = {
+                    'mode': args.mode,
+                    'baudrate': ser.baudrate,
+                    'payload_bytes': payload_bytes,
+                    'wire_bytes': ser.bytes_written - bytes_written,
+                    'seconds': upload_seconds,
+                    'payload_bytes_per_second': payload_bytes / upload_seconds,
+                    'line_bytes_per_second': line_bytes_per_second,
+                    'payload_share_of_line_rate': payload_bytes / upload_seconds / line_bytes_per_second,
+                }
+            else:
+                print('Skipping upload (--no-upload)...')
+            
+            if(verify and not supported('VERIFY_CRC') and not supported('DUMP')):
+                print('Skipping verification, the bootloader has neither crcs nor read-back...')
+            elif(verify):
+                with timed_phase('verify'):
+                    result['verify'] = verify_program(ser, image, comdefines, args, readback=not supported('VERIFY_CRC'))
+                    if(not supported('APPVALID')):
+                        if(args.verbose):
+                            print('Bootloader does not support marking the application as valid')
+                    elif(result['verify'] and not mark_application_valid(ser, image, comdefines, args)):
+                        result['error'] = 'application not marked as valid'
+            else:
+                print('Skipping verification (--no-verify)...')
 
-                hexfile['ssar'] = (segment, offset, checksum_ok)
+        # eeprom: only the ranges whose crc differs are written
+        if(eeprom_image is not None and (verify or upload)):
+            with timed_phase('eeprom'):
+                result['eeprom'] = False
+                if(not supported('EEPROM')):
+                    print('Skipping eeprom upload, the bootloader does not support the EEPROM...')
+                elif(eeprom_image['num_checksum_errors'] > 0 or eeprom_image['num_unknown_records'] > 0):
+                    print('Skipping eeprom upload, hex file contains invalid records...')
+                elif(upload and upload_eeprom(ser, eeprom_image, comdefines, args)):
+                    result['eeprom'] = not verify or verify_eeprom(ser, eeprom_image, comdefines, args)
+                elif(not upload and verify):
+                    result['eeprom'] = verify_eeprom(ser, eeprom_image, comdefines, args)
 
+        # Quit bootloader
+        if(not args.no_quit):
+            print()
+            with timed_phase('quit'):
+                ser.write(comdefines['BL_COM_CMD_QUIT'])
+                status = int.from_bytes(ser.read(size=1))
+            if(status == comdefines['BL_COM_REPLY_QUITTING']):
+                print('Bootloader quit OK')
             else:
-                print(f'Line {linenum:4}: Unknown record type {rtype}!')
-                hexfile['num_unknown_records'] += 1
-    
-    return hexfile
-
+                print(f'Error: Bootloader quit returned {status}')
+                result['error'] = f'quit returned {status}'
+
+        result['stats'] = {
+            'port': port,
+            'total_seconds': time.monotonic() - session_start,
+            'phases': stats['phases'],
+            'upload': upload_stats,
+            'bytes_written': ser.bytes_written,
+            'bytes_read': ser.bytes_read,
+            'round_trips': round_trip_stats(ser.round_trips, ser.timeouts),
+            'naks': stats['naks'],
+            'retries': stats['retries'],
+        }
+        result['ok'] = result['error'] is None and False not in [result['upload'], result['verify'], result['eeprom']]
+    except (SerialException, OSError) as e:
+        print(f'Serial port exception: {e}')
+        result['error'] = str(e)
+    finally:
+        result['seconds'] = time.monotonic() - session_start
+        if(ser is not None):
+            ser.close()
+    return result
+
+class DeviceOutput:
+    '''stdout for --ports: every line printed by a device thread is prefixed with the port, partial lines are kept per thread'''
+    def __init__(self, stream):
+        self.stream = stream
+        self.lock = threading.Lock()
+        self.partial = {}
+
+    def write(self, text):
+        thread = threading.current_thread()
+        if(thread is threading.main_thread()):
+            return self.stream.write(text)
+        lines = (self.partial.pop(thread.name, '') + text).split('\n')
+        self.partial[thread.name] = lines.pop()
+        with self.lock:
+            for line in lines:
+                self.stream.write(f'[{thread.name}] {line}\n')
+            self.stream.flush()
+        return len(text)
+
+    def flush(self):
+        self.stream.flush()
+
+def flash_devices(ports, args, comdefines, image, eeprom_image, parse_seconds):
+    # one thread per board, the serial timeouts keep a dead board from blocking longer than its own session
+    results = {}
+
+    def run(port):
+        results[port] = flash_device(port, args, comdefines, image, eeprom_image, parse_seconds)
+
+    stdout = sys.stdout
+    sys.stdout = DeviceOutput(stdout)
+    try:
+        threads = [threading.Thread(target=run, args=(port,), name=port, daemon=True) for port in ports]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+    finally:
+        sys.stdout = stdout
+    return [results.get(port, {'port': port, 'ok': False, 'error': 'session aborted', 'seconds': 0, 'stats': None, 'phases': {}}) for port in ports]
+
+def print_results(results):
+    def step(value):
+        return '-' if value is None else ('ok' if value else 'FAILED')
 
+    print()
+    print(f'{"port":20} {"result":6} {"upload":6} {"verify":6} {"eeprom":6} {"seconds":>7}  error')
+    for result in results:
+        print(f'{result["port"]:20} {"ok" if result["ok"] else "FAILED":6} {step(result.get("upload")):6} {step(result.get("verify")):6} '
+            f'{step(result.get("eeprom")):6} {result["seconds"]:7.2f}  {result["error"] or ""}')
+        # where the seconds went, the phases add up to them except for the checks between the phases
+        print(f'{"":20} ' + '  '.join(f'{name} {seconds:.2f}' for (name, seconds) in result['phases'].items()))
+    print(f'{sum(result["ok"] for result in results)} of {len(results)} devices OK')
 
 if __name__ == '__main__':
     os.system('color')
 
     parser = argparse.ArgumentParser(description='Upload firmware to Atmega328p based devices that run the corresponding bootloader')
-    parser.add_argument('--port', '-p', help='serial port', required=True)
+    ports = parser.add_mutually_exclusive_group(required=True)
+    ports.add_argument('--port', '-p', help='serial port')
+    ports.add_argument('--ports', nargs='+', metavar='PORT', help='flash several devices at once, one thread per port (output lines are prefixed with the port, a result table follows)')
     parser.add_argument('--baudrate', type=int, default=19200, help="baudrate of serial connection")
+    parser.add_argument('--max-baudrate', type=int, default=1000000, help='switch to the fastest working baudrate up to this one (0: keep --baudrate)')
     parser.add_argument('-f', '--file', help='firmware hex file')
+    parser.add_argument('--eeprom', metavar='EEPFILE', help='eeprom hex file (.eep), written after the flash and verified unless --no-verify')
+    parser.add_argument('--app-version', type=lambda value: int(value, 0), default=0, help='version stored in the image descriptor after a successful verification (0 - 65535)')
     parser.add_argument('--no-upload', action='store_true', help='skip upload')
+    parser.add_argument('--mode', choices=['hex', 'binary', 'window', 'page', 'compressed', 'diff'], default='page', help='upload as ascii hex records, binary frames (lock-step or windowed), complete (compressed) flash pages or only the pages whose crc differs')
+    parser.add_argument('--flow', choices=FLOW_MODES, default='none', help='flow control: xonxoff (ascii hex uploads only), rtscts (RTS / CTS lines, see main.c) or credit (windowed upload sends only what the bootloader has room for)')
+    parser.add_argument('--replace', action='store_true', help='erase the application section and upload the file as a whole image (no read-back of pages, uncovered pages stay erased)')
     parser.add_argument('--no-verify', action='store_true', help='skip upload verification')
     parser.add_argument('-r', '--fuses', action='store_true', help='read fuses')
     parser.add_argument('-i', '--info', action='store_true')
+    parser.add_argument('--dump', metavar='DUMPFILE', help='read the flash into a hex file before uploading (ranges of --file or the whole application section)')
+    parser.add_argument('--no-cache', action='store_true', help='always parse the hex file instead of using the cached image')
     parser.add_argument('--no-quit', action='store_true', help='don\'t quit bootloader after tasks are finished')
+    parser.add_argument('--stats', metavar='FILE', nargs='?', const='-', help='report phase times, throughput, round trip latencies and retries as json (to stdout without FILE)')
     parser.add_argument('-v', '--verbose', action='store_true')
 
     try:
@@ -421,72 +1435,30 @@ if __name__ == '__main__':
         comheader_filename = os.path.dirname(__file__) + '/../uart-bootloader/uart-bootloader/bootloader-communication.h'
         print(f'Reading com header file: {comheader_filename}')
         comdefines = extract_com_constants(comheader_filename)
-        #print('Com Defines:')
-        #pprint.pp(comdefines)
-
-        print(f'Trying to connect to bootloader on serial port {args.port} with BR {args.baudrate}...')
-
-        ser = Serial(args.port, args.baudrate, timeout=5)
-        time.sleep(0.1)
-
-        # request misc information from bootloader
-        bl_version = None
-        bl_section_start = None
-        status = serial_send_code(ser, 'BL_COM_CMD_INFO')
-        if(status & comdefines['BL_COM_REPLY_STATUSMASK'] == comdefines['BL_COM_REPLY_OK']):
-            bl_version_len = int.from_bytes(ser.read())
-            bl_version = ser.read(size=bl_version_len).decode('ascii')
-            bl_section_start_len = int.from_bytes(ser.read())
-            bl_section_start = int.from_bytes(ser.read(size=bl_section_start_len), byteorder='little')
-
-            if(args.info):
-                print('Bootloader Information:')
-                print(f'\tVersion: {bl_version}')
-                print(f'\tTool Version: {TOOL_VERSION}')
-                print(f'\tBootloader Section Start Address: 0x{bl_section_start:X}')
-        else:
-            print(f'Error: information request returned: {status}')
-
-        # read fuses
-        if(args.fuses):
-            time.sleep(1)
-            read_fuses(ser, comdefines, args)
 
-        # hex file: upload and / or verify
-        verify = not args.no_verify
-        upload = not args.no_upload
-        if(args.file and (verify or upload)):
-            time.sleep(1)
+        # the hex files are parsed once, also for several devices
+        image = None
+        eeprom_image = None
+        if(args.file and (not args.no_verify or not args.no_upload or args.dump)):
             print(f'Reading hex input file {args.file}: ', end='')
-            
-            hexfile = read_hex_file(args.file, bl_section_start, args.verbose)
-            
-            if(upload):
-                if(hexfile['bootloader_section_intersect']):
-                    print('Skipping upload to preserve bootloader...')
-                else:
-                    upload_program(ser, hexfile, comdefines, args)
-            else:
-                print('Skipping upload (--no-upload)...')
-            
-            if(verify):
-                verify_program(ser, hexfile, comdefines, args)
-            else:
-                print('Skipping verification (--no-verify)...')
-
-        # Quit bootloader
-        if(not args.no_quit):
-            print()
-            ser.write(comdefines['BL_COM_CMD_QUIT'])
-            status = int.from_bytes(ser.read(size=1))
-            if(status == comdefines['BL_COM_REPLY_QUITTING']):
-                print('Bootloader quit OK')
-            else:
-                print(f'Error: Bootloader quit returned {status}')
-
+            with timed_phase('parse'):
+                image = read_hex_image(args.file, comdefines['BL_COM_PAGESIZE'], args.verbose, not args.no_cache)
+        if(args.eeprom and (not args.no_verify or not args.no_upload)):
+            print(f'Reading eeprom input file {args.eeprom}: ', end='')
+            with timed_phase('parse'):
+                eeprom_image = read_hex_image(args.eeprom, comdefines['BL_COM_PAGESIZE'], args.verbose, not args.no_cache)
+
+        parse_seconds = stats['phases'].get('parse', 0)
+        if(args.ports):
+            results = flash_devices(args.ports, args, comdefines, image, eeprom_image, parse_seconds)
+            print_results(results)
+        else:
+            results = [flash_device(args.port, args, comdefines, image, eeprom_image, parse_seconds)]
 
+        if(args.stats):
+            reports = [result['stats'] for result in results]
+            write_stats(args.stats, reports if args.ports else reports[0])
 
-    except SerialException as e:
-        print(f'Serial port exception: {e}')
+        sys.exit(0 if all(result['ok'] for result in results) else 1)
     except KeyboardInterrupt:
-        exit()
\ No newline at end of file
+        exit()